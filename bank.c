@@ -0,0 +1,223 @@
+/* A Regular Expression Library - Shared Tables
+ * Copyright (c) 2012 Eric Mulvaney
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "core.h"
+
+/* Each table is known by the set of bytes it holds, a bit each.  A
+ * class is stored as one bit (mask) of a block of UCHAR_MAX+1 words;
+ * a first-byte table (mask 0) as UCHAR_MAX+1 bytes of its own.
+ */
+enum { KEYSIZE = (UCHAR_MAX+1) / 8 };
+
+struct Entry {
+  unsigned char key[KEYSIZE];
+  void *table;    /* NULL if the entry is free */
+  unsigned mask;
+};
+
+static unsigned
+hash(unsigned char *key, unsigned mask)
+{
+  unsigned h = 2166136261u ^ !!mask;  /* FNV-1a */
+  int i;
+
+  for(i = 0; i < KEYSIZE; i++)
+    h = (h ^ key[i]) * 16777619u;
+  return h;
+}
+
+/* Find where the table with key (a class if isclass) is, or should
+ * go.  The hash table is never more than half full.
+ */
+static struct Entry*
+lookup(struct Bank *b, unsigned char *key, int isclass)
+{
+  struct Entry *e = b->entries;
+  unsigned i = hash(key, isclass) & (b->max - 1);
+
+  for(; e[i].table; i = (i + 1) & (b->max - 1))
+    if(!!e[i].mask == isclass && !memcmp(e[i].key, key, KEYSIZE))
+      break;
+  return &e[i];
+}
+
+static int
+grow(struct Bank *b)
+{
+  struct Entry *old = b->entries, *e;
+  int i, max = b->max;
+
+  if(2 * (b->n + 1) <= b->max)
+    return 0;
+  e = calloc(max ? 2*max : 64, sizeof *e);
+  if(e == NULL) return (errno=ENOMEM, -1);
+  b->entries = e;
+  b->max = max ? 2*max : 64;
+  for(i = 0; i < max; i++)
+    if(old[i].table)
+      *lookup(b, old[i].key, !!old[i].mask) = old[i];
+  free(old);
+  b->bytes += (b->max - max) * sizeof *e;
+  return 0;
+}
+
+static unsigned*
+internclass(struct Bank *b, unsigned char *key, unsigned *mask)
+{
+  struct Entry *e;
+  int c;
+
+  if(grow(b)) return NULL;
+  e = lookup(b, key, 1);
+  if(!e->table) {
+    if(!b->block || !b->nextbit) {
+      b->block = calloc(UCHAR_MAX+1, sizeof *b->block);
+      if(b->block == NULL) return (errno=ENOMEM, NULL);
+      b->nextbit = 1;
+      b->bytes += (UCHAR_MAX+1) * sizeof *b->block;
+    }
+    for(c = 1; c <= UCHAR_MAX; c++)
+      if(key[c/8] & 1 << c%8)
+	b->block[c] |= b->nextbit;
+    memcpy(e->key, key, KEYSIZE);
+    e->table = b->block;
+    e->mask = b->nextbit;
+    b->nextbit <<= 1;  /* 0 once the block is full */
+    b->n++;
+  }
+  *mask = e->mask;
+  return e->table;
+}
+
+static unsigned char*
+internfirst(struct Bank *b, unsigned char *first)
+{
+  unsigned char key[KEYSIZE] = {0};
+  struct Entry *e;
+  int c;
+
+  for(c = 0; c <= UCHAR_MAX; c++)
+    if(first[c])
+      key[c/8] |= 1 << c%8;
+  if(grow(b)) return NULL;
+  e = lookup(b, key, 0);
+  if(!e->table) {
+    if((e->table = malloc(UCHAR_MAX+1)) == NULL)
+      return (errno=ENOMEM, NULL);
+    memcpy(e->table, first, UCHAR_MAX+1);
+    memcpy(e->key, key, KEYSIZE);
+    e->mask = 0;
+    b->bytes += UCHAR_MAX+1;
+    b->n++;
+  }
+  return e->table;
+}
+
+int
+compact(struct Program *prog, struct Bank *bank)
+{
+  struct Inst *code, *pc;
+  unsigned char key[KEYSIZE], *first = NULL;
+  size_t len = 0;
+  int c;
+
+  if(!prog || !bank || !prog->code || prog->size < 1)
+    return (errno=EINVAL, -1);
+  if(prog->options & Compact)
+    return 0;
+  if(prog->first && (first = internfirst(bank, prog->first)) == NULL)
+    return -1;
+  if(prog->literal)
+    len = strlen(prog->literal) + 1;
+  code = malloc(prog->size * sizeof *code + len);
+  if(code == NULL)
+    return (errno=ENOMEM, -1);
+  memcpy(code, prog->code, prog->size * sizeof *code);
+  for(pc = code; pc < code + prog->size; pc++) {
+    switch(pc->opcode) {
+    case Split:
+      pc->args.next.y = code + (pc->args.next.y - prog->code);
+      /* no break */
+    case Jump:
+      pc->args.next.x = code + (pc->args.next.x - prog->code);
+      break;
+    case CharSet:
+      memset(key, 0, sizeof key);
+      for(c = 1; c <= UCHAR_MAX; c++)
+	if(pc->args.set.charset[c] & pc->args.set.mask)
+	  key[c/8] |= 1 << c%8;
+      pc->args.set.charset = internclass(bank, key, &pc->args.set.mask);
+      if(pc->args.set.charset == NULL) {
+	free(code);
+	return -1;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  if(len)
+    memcpy(code + prog->size, prog->literal, len);
+  if(!(prog->options & InArena)) {
+    free(prog->code);
+    free(prog->literal);
+    free(prog->charset);
+    free(prog->first);
+  }
+  prog->code = code;
+  prog->literal = len ? (char*)(code + prog->size) : NULL;
+  prog->charset = NULL;
+  prog->first = first;
+  prog->options = (prog->options & ~InArena) | Compact;
+  return 0;
+}
+
+void
+freebank(struct Bank *bank)
+{
+  struct Entry *e = bank->entries;
+  int i;
+
+  for(i = 0; i < bank->max; i++)
+    if(e[i].table && e[i].mask <= 1)  /* a first table, or a block */
+      free(e[i].table);
+  free(bank->entries);
+  memset(bank, 0, sizeof *bank);
+}
+
+size_t
+progsize(struct Program *prog)
+{
+  size_t n = sizeof *prog;
+
+  if(!prog->code)
+    return n;
+  n += prog->size * sizeof *prog->code;
+  if(prog->literal)
+    n += strlen(prog->literal) + 1;
+  if(prog->charset)
+    n += (UCHAR_MAX+1) * sizeof *prog->charset;
+  if(prog->first && !(prog->options & Compact))
+    n += UCHAR_MAX+1;
+  if(prog->dfa)
+    n += sizeof *prog->dfa + prog->dfa->nstates *
+      (1 + prog->dfa->nclasses * sizeof *prog->dfa->trans);
+  return n;
+}
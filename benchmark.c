@@ -0,0 +1,516 @@
+/* A Regular Expression Library - Benchmark Driver
+ * Copyright (c) 2012 Eric Mulvaney
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "core.h"
+
+/* Every corpus is generated from the same seed, so each run sees the
+ * same input; only the timings should differ between commits.  Lines
+ * are stored NUL-terminated, one after another, as vm() expects.
+ */
+struct Corpus {
+  char *name;
+  void (*generate)(struct Corpus *c, size_t size);
+  char *text, **lines;
+  size_t size;
+  int nlines;
+};
+
+struct Pattern {
+  char *name, *regex;
+  int options;
+};
+
+struct Result {
+  double compile_ns, scan_ns, batch_ns;
+  long matches, scanned;
+  size_t compile_peak, vm_peak;
+};
+
+/* The library's allocations are routed here by the linker (see the
+ * Makefile), so the peak heap use of compile() and vm() can be found.
+ * Each block is preceded by its size.
+ */
+void *__real_malloc(size_t size);
+void *__real_realloc(void *p, size_t size);
+void __real_free(void *p);
+
+static size_t inuse, peak;
+
+enum { HEADER = 16 };  /* keeps the caller's block aligned */
+
+void*
+__wrap_malloc(size_t size)
+{
+  char *p = __real_malloc(HEADER + size);
+  if(p == NULL) return NULL;
+  *(size_t*)p = size;
+  if((inuse += size) > peak) peak = inuse;
+  return p + HEADER;
+}
+
+void*
+__wrap_calloc(size_t n, size_t size)
+{
+  void *p;
+  if(size && n > (size_t)-1 / size) return (errno=ENOMEM, NULL);
+  if((p = __wrap_malloc(n * size)) != NULL) memset(p, 0, n * size);
+  return p;
+}
+
+void
+__wrap_free(void *p)
+{
+  if(p == NULL) return;
+  p = (char*)p - HEADER;
+  inuse -= *(size_t*)p;
+  __real_free(p);
+}
+
+void*
+__wrap_realloc(void *p, size_t size)
+{
+  char *q;
+  if(p == NULL) return __wrap_malloc(size);
+  q = __real_realloc((char*)p - HEADER, HEADER + size);
+  if(q == NULL) return NULL;
+  inuse -= *(size_t*)q;
+  *(size_t*)q = size;
+  if((inuse += size) > peak) peak = inuse;
+  return q + HEADER;
+}
+
+static unsigned long long seed;
+
+static unsigned
+rnd(unsigned n)
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return (unsigned)(seed >> 32) % n;
+}
+
+static char *words[] = {
+  "alice", "bob", "carol", "dave", "erin", "frank", "grace", "heidi",
+  "GET", "POST", "item", "user", "session", "cache", "timeout", "error",
+  "aaaaaaaa", "retry", "index", "queue"
+};
+enum { NWORDS = sizeof words / sizeof *words };
+
+static int
+addline(struct Corpus *c, char *line, size_t len, size_t *max)
+{
+  if(c->size + len + 1 > *max) return 0;
+  memcpy(c->text + c->size, line, len);
+  c->lines[c->nlines++] = c->text + c->size;
+  c->size += len;
+  c->text[c->size++] = '\0';
+  return 1;
+}
+
+static void
+genlog(struct Corpus *c, size_t size)
+{
+  static char *levels[] = { "INFO", "INFO", "INFO", "WARN", "ERROR" };
+  char line[256];
+  int n;
+
+  do {
+    n = sprintf(line, "2012-%02u-%02u %02u:%02u:%02u %s [worker-%u] "
+		"%s /api/v1/%s/%u user=%s status=%u time=%ums",
+		rnd(12)+1, rnd(28)+1, rnd(24), rnd(60), rnd(60),
+		levels[rnd(5)], rnd(32), words[8+rnd(2)], words[10+rnd(4)],
+		rnd(100000), words[rnd(8)], rnd(5) ? 200 : 500 + rnd(4),
+		rnd(2000));
+  } while(addline(c, line, n, &size));
+}
+
+static void
+genlong(struct Corpus *c, size_t size)
+{
+  char *w, *line = malloc(1<<16);
+  size_t n, len;
+
+  if(line == NULL) return;
+  do {
+    for(n = 0; n < (1<<16) - 16; n += len + 1) {
+      w = words[rnd(NWORDS)];
+      len = strlen(w);
+      memcpy(line + n, w, len);
+      line[n+len] = ' ';
+    }
+  } while(addline(c, line, n, &size));
+  free(line);
+}
+
+static void
+genbinary(struct Corpus *c, size_t size)
+{
+  char line[256];
+  int i, n;
+
+  do {
+    n = rnd(sizeof line);
+    for(i = 0; i < n; i++)
+      line[i] = 1 + rnd(UCHAR_MAX);
+    for(i = 0; i < n; i++)
+      if(line[i] == '\n') line[i] = ' ';
+  } while(addline(c, line, n, &size));
+}
+
+static void
+genutf8(struct Corpus *c, size_t size)
+{
+  static char *utf8words[] = {
+    "café", "naïve", "straße", "σοφία", "Σοφία", "λόγος", "мир",
+    "Москва", "日本語", "東京", "한국어", "emoji😀", "plain", "ascii"
+  };
+  char line[256];
+  int i, n;
+
+  do {
+    for(i = n = 0; i < 12; i++)
+      n += sprintf(line + n, "%s ", utf8words[rnd(14)]);
+  } while(addline(c, line, n, &size));
+}
+
+static struct Corpus corpora[] = {
+  { "log",    genlog    },
+  { "long",   genlong   },
+  { "binary", genbinary },
+  { "utf8",   genutf8   }
+};
+enum { NCORPORA = sizeof corpora / sizeof *corpora };
+
+static struct Pattern patterns[] = {
+  { "literal",     "status=500" },
+  { "literal-i",   "timeout", IgnoreCase },
+  { "class",       "[0-9][0-9]:[0-9][0-9]:[0-9][0-9] ERROR" },
+  { "class-start", "[0-9][0-9][0-9][0-9]-" },
+  { "alt-8",       "alice|bob|carol|dave|erin|frank|grace|heidi" },
+  { "alt-16",      "(alice|bob|carol|dave|erin|frank|grace|heidi|"
+		   "GET|POST|item|user|session|cache|retry|queue)=" },
+  { "anchored",    "^2012-0[1-6]" },
+  { "end",         "time=1[0-9]*ms$" },
+  { "nested",      "((a|b)*c|(d|e)+f)*g" },
+  { "dotstar",     "user=.*status=.*time" },
+  { "star-star",   "(a*)*b" },
+  { "plus-plus",   "(a+a+)+b" },
+  { "captures",    "([a-z]+)/([0-9]+) user=([a-z]+)" },
+  { "utf8-class",  "[α-ω]+ [А-Я]", UTF8 },
+  { "utf8-dot",    "ï.*語", UTF8 },
+  { "utf8-i",      "ΣΟΦΊΑ", UTF8|IgnoreCase }
+};
+enum { NPATTERNS = sizeof patterns / sizeof *patterns };
+
+/* Rules for tokenizing the log corpus with scan() (see tokenize()). */
+static struct Rule rules[] = {
+  { "[0-9]+-[0-9]+-[0-9]+", 1 },
+  { "[0-9]+:[0-9]+:[0-9]+", 2 },
+  { "INFO|WARN|ERROR",      3 },
+  { "\\[[a-z]+-[0-9]+\\]", 4 },
+  { "GET|POST",             5 },
+  { "(/[a-z0-9]+)+",        6 },
+  { "[a-z]+=",              7 },
+  { "[a-z]+",               8 },
+  { "[0-9]+",               9 },
+  { "[0-9]+ms",             10 },
+  { " +",                   11 },
+  { ".",                    12 }
+};
+enum { NRULES = sizeof rules / sizeof *rules };
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Time compile(), vm() and matchbatch() for one pattern on one
+ * corpus; each runs repeatedly until at least mintime nanoseconds have
+ * passed.  The results of matchbatch() are checked against vm()'s.
+ */
+static int
+measure(struct Result *r, struct Pattern *p, struct Corpus *c,
+	int options, double mintime, int *results)
+{
+  struct Program prog;
+  char *saved[20];
+  double start, end;
+  size_t base;
+  long n;
+  int i, rc;
+
+  memset(r, 0, sizeof *r);
+  start = now();
+  for(n = 0; (end = now()) - start < mintime || n < 1; n++) {
+    if(n) freeprogram(&prog);
+    peak = base = inuse;
+    if(compile(&prog, p->regex, p->options | options)) return -1;
+    r->compile_peak = peak - base;
+  }
+  r->compile_ns = (end - start) / n;
+  peak = base = inuse;
+  start = now();
+  for(n = 0; (end = now()) - start < mintime || n < 1; n++) {
+    r->matches = 0;
+    for(i = 0; i < c->nlines; i++) {
+      if((rc = vm(&prog, c->lines[i], saved)) < 0) return -1;
+      r->matches += rc;
+    }
+  }
+  r->scan_ns = (end - start) / n;
+  r->scanned = c->size;
+  r->vm_peak = peak - base;
+  start = now();
+  for(n = 0; (end = now()) - start < mintime || n < 1; n++)
+    if(matchbatch(&prog, c->lines, c->nlines, results) < 0)
+      return -1;
+  r->batch_ns = (end - start) / n;
+  freeprogram(&prog);
+  for(n = i = 0; i < c->nlines; i++)
+    n += results[i];
+  if(n != r->matches)  /* matchbatch() disagrees with vm() */
+    return (errno=EPROTO, -1);
+  return 0;
+}
+
+/* Time scan() splitting every line of a corpus into tokens. */
+static int
+tokenize(struct Corpus *c, double mintime)
+{
+  struct Program prog;
+  struct Matcher m;
+  double start, end;
+  char *sp, *next;
+  long n, tokens = 0;
+  int i, id, rc = 0;
+
+  if(compilerules(&prog, rules, NRULES, 0) || initmatcher(&m, &prog)) {
+    perror("tokens");
+    return -1;
+  }
+  start = now();
+  for(n = 0; (end = now()) - start < mintime || n < 1; n++) {
+    tokens = 0;
+    for(i = 0; i < c->nlines; i++) {
+      for(sp = c->lines[i]; *sp; sp = next, tokens++) {
+	if((rc = scan(&m, sp, &next, &id)) <= 0)
+	  break;
+      }
+      if(rc < 0) break;
+    }
+  }
+  freematcher(&m);
+  freeprogram(&prog);
+  if(rc < 0) {
+    perror("tokens");
+    return -1;
+  }
+  printf("%-8s %-12s %10.1f %10.0f %8ld\n", c->name, "tokens",
+	 c->size / ((end - start) / n) * 1e9 / (1<<20),
+	 (end - start) / n / tokens, tokens);
+  return 0;
+}
+
+/* Time compiling every pattern, each into its own heap blocks with
+ * compile(), then all into one arena with compileinto(), and find the
+ * peak heap use of each.
+ */
+static int
+bulk(int options, double mintime)
+{
+  static struct Program progs[NPATTERNS];
+  struct Arena arena = {0};
+  struct Pattern *p;
+  double start, end;
+  size_t base;
+  long n;
+  int i, rc = 0, inarena;
+
+  for(i = 0; i < NPATTERNS; i++)
+    arena.size += arenasize(patterns[i].regex, patterns[i].options | options);
+  if((arena.base = malloc(arena.size)) == NULL) {
+    perror("bulk");
+    return -1;
+  }
+  for(inarena = 0; inarena < 2 && rc == 0; inarena++) {
+    start = now();
+    for(n = 0; rc == 0 && ((end = now()) - start < mintime || n < 1); n++) {
+      peak = base = inuse;
+      arena.used = 0;
+      for(i = 0; i < NPATTERNS; i++) {
+	p = &patterns[i];
+	rc = inarena ? compileinto(&progs[i], p->regex, p->options | options,
+				   &arena)
+		     : compile(&progs[i], p->regex, p->options | options);
+	if(rc) {
+	  perror(p->name);
+	  break;
+	}
+      }
+      while(i-- > 0)
+	freeprogram(&progs[i]);
+    }
+    if(rc == 0)
+      printf("%-8s %-12s %10.0f ns/pattern %10lu B heap\n", "compile",
+	     inarena ? "arena" : "heap", (end - start) / n / NPATTERNS,
+	     (unsigned long)(peak - base));
+  }
+  free(arena.base);
+  return rc;
+}
+
+/* Compile an inventory of n small patterns, such as might be kept for
+ * each of many users, and find the memory they hold (their Programs
+ * included) before and after compact(), then the time to match them
+ * all against a line.
+ */
+static int
+inventory(int n, double mintime)
+{
+  struct Program *progs;
+  struct Bank bank = {0};
+  char regex[64], *saved[20], *line = "2012-03-04 12:34:56 ERROR "
+    "[worker-7] GET /api/v1/session/123 user=carol status=503 time=42ms";
+  double start, end, ns[2];
+  size_t base, bytes[2];
+  long k;
+  int i, j, rc = 0;
+
+  if((progs = malloc(n * sizeof *progs)) == NULL) {
+    perror("inventory");
+    return -1;
+  }
+  base = inuse;
+  for(i = 0; i < n && rc == 0; i++) {
+    switch(rnd(5)) {
+    case 0: sprintf(regex, "%s", words[rnd(NWORDS)]); break;
+    case 1: sprintf(regex, "user=%s", words[rnd(8)]); break;
+    case 2: sprintf(regex, "status=%u[0-9][0-9]", 2 + rnd(4)); break;
+    case 3: sprintf(regex, "(%s|%s)=[a-z]+", words[rnd(NWORDS)],
+		    words[rnd(NWORDS)]); break;
+    case 4: sprintf(regex, "time=%u[0-9]*ms$", 1 + rnd(9)); break;
+    }
+    if((rc = compile(&progs[i], regex, rnd(4) ? 0 : IgnoreCase)) < 0)
+      perror(regex);
+  }
+  for(j = 0; j < 2 && rc == 0; j++) {
+    bytes[j] = inuse - base + n * sizeof *progs;
+    start = now();
+    for(k = 0; (end = now()) - start < mintime || k < 1; k++)
+      for(i = 0; i < n; i++)
+	if(vm(&progs[i], line, saved) < 0)
+	  rc = -1;
+    ns[j] = (end - start) / k / n;
+    for(i = 0; i < n && j == 0 && rc == 0; i++)
+      rc = compact(&progs[i], &bank);
+  }
+  if(rc == 0)
+    printf("%-8s %-12s %10.0f B/program %10.0f B/program %8.0f ns %8.0f ns\n",
+	   "programs", "compact", (double)bytes[0] / n, (double)bytes[1] / n,
+	   ns[0], ns[1]);
+  else
+    perror("inventory");
+  while(i-- > 0)
+    freeprogram(&progs[i]);
+  freebank(&bank);
+  free(progs);
+  return rc;
+}
+
+static int
+run(struct Pattern *p, struct Corpus *c, int options, double mintime,
+    int *results)
+{
+  struct Result r;
+
+  if(measure(&r, p, c, options, mintime, results) < 0) {
+    perror(p->name);
+    return -1;
+  }
+  printf("%-8s %-12s %10.1f ", c->name, p->name,
+	 r.scanned / r.scan_ns * 1e9 / (1<<20));
+  if(r.matches)
+    printf("%10.0f ", r.scan_ns / r.matches);
+  else
+    printf("%10s ", "-");
+  printf("%8ld %10.0f %10lu %8lu %10.1f\n", r.matches, r.compile_ns,
+	 (unsigned long)r.compile_peak, (unsigned long)r.vm_peak,
+	 r.scanned / r.batch_ns * 1e9 / (1<<20));
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct Corpus *c;
+  double mintime = 0.2e9;
+  size_t size = 1<<20;
+  int i, j, opt, options = 0, errors = 0, *results;
+
+  while((opt = getopt(argc, argv, "Ds:t:")) != -1) {
+    switch(opt) {
+      case 'D': options |= BuildDFA;           break;
+      case 's': size    = strtoul(optarg, 0, 0); break;
+      case 't': mintime = atof(optarg) * 1e9;  break;
+      default: goto badargs;
+    }
+  }
+  if(optind < argc) {
+  badargs:
+    fprintf(stderr, "usage: %s [-D] [-s bytes] [-t seconds]\n", argv[0]);
+    return 2;
+  }
+  for(i = 0; i < NCORPORA; i++) {
+    c = &corpora[i];
+    seed = 88172645463325252ULL;
+    c->text = malloc(size);
+    c->lines = malloc((size/2 + 1) * sizeof *c->lines);
+    if(!c->text || !c->lines) {
+      perror("bench");
+      return 2;
+    }
+    c->generate(c, size);
+  }
+  if((results = malloc((size/2 + 1) * sizeof *results)) == NULL) {
+    perror("bench");
+    return 2;
+  }
+  printf("%-8s %-12s %10s %10s %8s %10s %10s %8s %10s\n", "corpus",
+	 "pattern", "MB/s", "ns/match", "matches", "compile-ns", "compile-B",
+	 "vm-B", "batch-MB/s");
+  for(i = 0; i < NCORPORA; i++)
+    for(j = 0; j < NPATTERNS; j++)
+      if(run(&patterns[j], &corpora[i], options, mintime, results) < 0)
+	errors = 1;
+  if(tokenize(&corpora[0], mintime) < 0)
+    errors = 1;
+  if(bulk(options, mintime) < 0)
+    errors = 1;
+  if(inventory(10000, mintime) < 0)
+    errors = 1;
+  return errors ? 2 : 0;
+}
@@ -0,0 +1,136 @@
+# A Regular Expression Library - Case Folding Tables
+# Copyright (c) 2012 Eric Mulvaney
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Print folds[] and orbits[] for utf8.c from Unicode's CaseFolding.txt:
+#
+#     awk -f casefold.awk CaseFolding.txt
+#
+# Only simple folding is used (status C and S).  Code points that fold
+# together are one set of cases: a pair goes in folds[], as part of a
+# run, and a larger set in orbits[].  Since casefold() looks in orbits[]
+# first, a run may pass over their members.
+
+BEGIN { FS = "; "; MAX = 0 }
+
+function hex(s,    i, n) {
+    n = 0
+    for(i = 1; i <= length(s); i++)
+	n = n * 16 + index("0123456789ABCDEF", toupper(substr(s, i, 1))) - 1
+    return n
+}
+
+$2 == "C" || $2 == "S" {
+    c = hex($1); to[c] = hex($3)
+    name[c] = $4; sub(/^# */, "", name[c])
+    if(c > MAX) MAX = c
+    if(to[c] > MAX) MAX = to[c]
+}
+
+# A delta run is printed two to a line, an Alternate run alone.
+function entry(lo, hi, delta,    s) {
+    s = sprintf("{ 0x%04X, 0x%04X, %s },", lo, hi, delta)
+    if(delta == "Alternate") {
+	if(held) print "  " held
+	print "  " s
+	held = ""
+    } else if(held) {
+	printf "  %-26s%s\n", held, s
+	held = ""
+    } else {
+	held = s
+    }
+}
+
+function endrun() {
+    if(lo >= 0)
+	entry(lo, last, kind == "alt" ? "Alternate" : delta)
+    lo = -1
+}
+
+END {
+    for(c in to) {  # gather each set of cases under what they fold to
+	f = to[c]
+	if(!(f in size)) { size[f] = 1; set[f, 1] = f }
+	set[f, ++size[f]] = c
+    }
+    for(f in size) {
+	if(size[f] == 2) {
+	    other[f] = set[f, 2]
+	    other[set[f, 2]] = f
+	} else {
+	    if(size[f] > 4) {
+		print "casefold.awk: more than 4 cases of " f >"/dev/stderr"
+		exit 1
+	    }
+	    for(i = 1; i <= size[f]; i++)
+		inorbit[set[f, i]] = f
+	}
+    }
+
+    print "static const struct Fold {"
+    print "  int lo, hi, delta;"
+    print "} folds[] = {"
+    lo = -1
+    for(c = 0; c <= MAX; c++) {
+	if(c in other) {
+	    d = other[c] - c
+	} else if(c in inorbit) {
+	    continue  # any run may take it
+	} else {
+	    endrun()
+	    continue
+	}
+	if(lo >= 0) {
+	    if(kind == "" && delta == 1 && d == -1 && c == lo + 1)
+		kind = "alt"
+	    else if(kind == "" && d == delta)
+		kind = "delta"
+	    if(kind == "alt" && d == ((c - lo) % 2 ? -1 : 1) ||
+	       kind != "alt" && d == delta) {
+		last = c
+		continue
+	    }
+	    endrun()
+	}
+	lo = last = c; delta = d; kind = ""
+    }
+    endrun()
+    if(held) print "  " held
+    print "};"
+    print "enum { NFOLDS = sizeof folds / sizeof *folds };"
+    print ""
+
+    print "static const int orbits[][4] = {"
+    norbits = 0
+    for(c = 0; c <= MAX; c++) {
+	if(!(c in inorbit) || inorbit[c] in done) continue
+	f = inorbit[c]; done[f] = 1
+	s = ""; comment = ""
+	for(i = c; i <= MAX; i++) {  # in order
+	    if(!(i in inorbit) || inorbit[i] != f) continue
+	    s = s (s ? ", " : "") sprintf("0x%04X", i)
+	    if(i in name) comment = name[i]
+	}
+	gsub(/(CAPITAL |SMALL )?LETTER /, "", comment)
+	orbit[++norbits] = sprintf("{ %s }", s)
+	comments[norbits] = comment
+    }
+    for(i = 1; i <= norbits; i++)
+	printf "  %-36s/* %s */\n", orbit[i] (i < norbits ? "," : ""),
+	    comments[i]
+    print "};"
+    print "enum { NORBITS = sizeof orbits / sizeof *orbits };"
+}
@@ -68,7 +68,7 @@ $1 == "+" && NF > 3 { die("Too many fields: '" $0 "'") }
 {
     print $2 > tmp
     if($1 == "+") {
-	if($3) expect = expect $3 RS
+	if($3) { gsub(/\\n/, RS, $3); expect = expect $3 RS }
 	else   expect = expect $2 RS
     }
 }
@@ -0,0 +1,104 @@
+# A Regular Expression Library - File Tests
+# Copyright (c) 2012 Eric Mulvaney
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Tests of how grep reads its files, which check.tests (always one
+# regex on standard input) can't reach.  Run from make check.
+
+dir=check.dir
+failed=0
+rm -rf $dir && mkdir $dir || exit 2
+
+# expect NAME STATUS OUTPUT: compare with what's in $dir/out and $?.
+expect() {
+    got=$(cat $dir/out)
+    if [ "$got" = "$3" ] && [ $rc = $2 ]; then
+	echo "$1  # ok"
+    else
+	failed=1
+	echo "$1  # FAILED"
+	printf 'GOT (%s):\n%s\nEXPECTED (%s):\n%s\n' $rc "$got" $2 "$3"
+    fi
+}
+
+# Many files at once are read ahead (see prefetch() in input.c), more
+# of them than there are buffers, one bigger than a buffer.
+i=0; want=
+while [ $i -lt 40 ]; do
+    echo "line $i" >$dir/f$i
+    want="$want${want:+
+}$dir/f$i:line $i"
+    i=$((i + 1))
+done
+awk 'BEGIN { for(i = 0; i < 20000; i++) print "pad " i; print "line end" }' \
+    >$dir/f$i
+./grep 'line' $dir/f* >$dir/out; rc=$?
+sort -o $dir/out $dir/out
+want=$(printf '%s\n%s:line end\n' "$want" $dir/f40 | sort)
+expect "many files" 0 "$want"
+
+# A pipe's first read can come up short without being its end.
+mkfifo $dir/p1 $dir/p2 || exit 2
+(echo abc; sleep 1; echo abd) >$dir/p1 &
+(echo abc; sleep 1; echo abd) >$dir/p2 &
+./grep 'ab' $dir/p1 $dir/p2 >$dir/out; rc=$?
+wait
+expect "pipes" 0 "$dir/p1:abc
+$dir/p1:abd
+$dir/p2:abc
+$dir/p2:abd"
+
+# Each file's output comes out before any message about the next.
+echo abc >$dir/a
+./grep 'ab' $dir/a $dir/missing $dir/a >$dir/out 2>&1; rc=$?
+expect "messages in order" 2 "$dir/a:abc
+$dir/missing: No such file or directory
+$dir/a:abc"
+
+# A line longer than any buffer is still one line, and a match can
+# span where it was read in pieces.
+awk 'BEGIN { s = "x"; while(length(s) < 20000) s = s s
+	     print "y" s "ab" s "z"; print "a"; print "b"; print "a" }' >$dir/long
+./grep -n '^a' $dir/long >$dir/out; rc=$?
+expect "long line numbers" 0 "$dir/long:2:a
+$dir/long:4:a"
+./grep -c 'x' $dir/long >$dir/out; rc=$?
+expect "long line count" 0 "$dir/long:1"
+./grep -c '^yx+abx+z$' $dir/long >$dir/out; rc=$?
+expect "long line match" 0 "$dir/long:1"
+
+# Compressed input is inflated as it's read (see startgzip() in
+# input.c): whole members one after another, enough of them to fill
+# the ring of blocks, and a stream cut short.
+if command -v gzip >/dev/null; then
+    printf 'abc\nxyz\n' | gzip >$dir/z
+    printf 'abd\n' | gzip >>$dir/z
+    ./grep 'ab' <$dir/z >$dir/out; rc=$?
+    expect "gzip members" 0 "abc
+abd"
+
+    awk 'BEGIN { for(i = 0; i < 200000; i++) print "line " i }' |
+	gzip >$dir/z
+    ./grep -c 'line' $dir/z >$dir/out; rc=$?
+    expect "gzip blocks" 0 "$dir/z:200000"
+
+    head -c 30000 $dir/z >$dir/cut
+    ./grep 'line' $dir/cut >/dev/null 2>$dir/out; rc=$?
+    expect "gzip cut short" 2 "$dir/cut: Bad message"
+fi
+
+rm -rf $dir
+[ $failed = 0 ] && echo "# All file tests passed."
+exit $failed
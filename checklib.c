@@ -0,0 +1,230 @@
+/* A Regular Expression Library - Library Tests
+ * Copyright (c) 2012 Eric Mulvaney
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Tests of the interfaces grep doesn't use, and so check.tests can't
+ * reach.  Run from make check.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "core.h"
+
+static int failed;
+
+static void
+result(char *what, char *input, int ok)
+{
+  printf("%s '%s'  # %s\n", what, input, ok ? "ok" : "FAILED");
+  if(!ok) failed = 1;
+}
+
+/* The first rule to match the longest token wins; "x$" only matches
+ * at the end, where it ties with [a-z]+ and is listed first.
+ */
+static struct Rule rules[] = {
+  { "if",     1 },
+  { "x$",     2 },
+  { "[a-z]+", 3 },
+  { "[0-9]+", 4 },
+  { "=",      5 },
+  { "==",     6 },
+};
+enum { NRULES = sizeof rules / sizeof *rules };
+
+static struct {
+  char *input;
+  int id, len;  /* id 0: no token */
+} tokens[] = {
+  { "iffy",  3, 4 },  /* longer than "if" */
+  { "if x",  1, 2 },  /* a tie: the first rule wins */
+  { "x",     2, 1 },
+  { "xy",    3, 2 },
+  { "x y",   3, 1 },
+  { "==3",   6, 2 },
+  { "=3",    5, 1 },
+  { "123ab", 4, 3 },
+  { "#if",   0, 0 },
+  { "",      0, 0 },
+};
+enum { NTOKENS = sizeof tokens / sizeof *tokens };
+
+static void
+checkscan(void)
+{
+  struct Program prog;
+  struct Matcher m;
+  struct Rule many[40];
+  char regex[40][16], *end;
+  int i, id, rc;
+
+  if(compilerules(&prog, rules, NRULES, 0) || initmatcher(&m, &prog)) {
+    perror("compilerules");
+    exit(2);
+  }
+  for(i = 0; i < NTOKENS; i++) {
+    end = NULL;
+    id = 0;
+    rc = scan(&m, tokens[i].input, &end, &id);
+    result("scan", tokens[i].input, tokens[i].id ?
+	   rc == 1 && id == tokens[i].id &&
+	   end == tokens[i].input + tokens[i].len : rc == 0);
+  }
+  freematcher(&m);
+  freeprogram(&prog);
+
+  /* More rules than class bits, but only one distinct class. */
+  for(i = 0; i < 40; i++) {
+    sprintf(regex[i], "k%d[a-z]+", i);
+    many[i].regex = regex[i];
+    many[i].id = i + 1;
+  }
+  rc = compilerules(&prog, many, 40, 0);
+  result("compilerules", "k<i>[a-z]+ x 40", rc == 0);
+  if(rc) return;
+  if(initmatcher(&m, &prog)) {
+    perror("initmatcher");
+    exit(2);
+  }
+  rc = scan(&m, "k39abc", &end, &id);
+  result("scan", "k39abc", rc == 1 && id == 40 && !*end);
+  freematcher(&m);
+  freeprogram(&prog);
+}
+
+/* A token of eight letters takes more than 4 steps, if fewer than 100. */
+static void
+checkscansteps(void)
+{
+  struct Limits limits = {0};
+  struct Program prog;
+  struct Matcher m;
+  char *end;
+  int id, rc;
+
+  if(compilerules(&prog, rules, NRULES, 0) || initmatcher(&m, &prog)) {
+    perror("compilerules");
+    exit(2);
+  }
+  prog.limits = &limits;
+  limits.maxsteps = 4;
+  errno = 0;
+  rc = scan(&m, "abcdefgh", &end, &id);
+  result("scan maxsteps 4", "abcdefgh", rc < 0 && errno == ETIME);
+  limits.maxsteps = 100;
+  rc = scan(&m, "abcdefgh", &end, &id);
+  result("scan maxsteps 100", "abcdefgh", rc == 1 && id == 3 && !*end);
+  freematcher(&m);
+  freeprogram(&prog);
+}
+
+/* Where a maxdepth of 4 sits: groups and repetitions count, but not
+ * alternatives, nor the group and prefix that parse() adds.
+ */
+static struct {
+  char *regex;
+  int ok;
+} nested[] = {
+  { "GET|POST|PUT|DELETE|HEAD|OPTIONS", 1 },
+  { "((((a))))",                        1 },
+  { "(((((a)))))",                      0 },
+  { "(((a*)))",                         1 },
+  { "((((a*))))",                       0 },
+  { "(a|(b|(c|(d))))",                  1 },
+  { "(a|(b|(c|(d|(e)))))",              0 },
+  { "^((((a))))$",                      1 },
+};
+enum { NNESTED = sizeof nested / sizeof *nested };
+
+static struct {
+  char *regex;
+  int options, ok;
+} sizes[] = {
+  { "abcde",  0,    1 },
+  { "abcdef", 0,    0 },
+  { ".",      0,    1 },
+  { ".",      UTF8, 0 },  /* one Ranges, but many sequences */
+};
+enum { NSIZES = sizeof sizes / sizeof *sizes };
+
+static void
+checklimits(void)
+{
+  struct Limits limits = {0};
+  struct Program prog;
+  int i, rc;
+
+  limits.maxdepth = 4;
+  for(i = 0; i < NNESTED; i++) {
+    errno = 0;
+    rc = compilelimited(&prog, nested[i].regex, 0, &limits);
+    result("maxdepth 4", nested[i].regex,
+	   nested[i].ok ? rc == 0 : rc < 0 && errno == E2BIG);
+    if(rc == 0)
+      freeprogram(&prog);
+  }
+
+  /* maxsize is checked against the most a regex could need: 2 per
+   * byte and MIN_CODESIZE (6), plus any UTF-8 ranges' sequences.
+   */
+  limits.maxdepth = 0;
+  limits.maxsize = 16;
+  for(i = 0; i < NSIZES; i++) {
+    errno = 0;
+    rc = compilelimited(&prog, sizes[i].regex, sizes[i].options, &limits);
+    result("maxsize 16", sizes[i].regex,
+	   sizes[i].ok ? rc == 0 : rc < 0 && errno == E2BIG);
+    if(rc == 0)
+      freeprogram(&prog);
+  }
+}
+
+/* 33 distinct classes: one past the class bits, which only UTF8 can
+ * go beyond (the 33rd becomes Ranges; see pushranges()).
+ */
+static void
+checkclasses(void)
+{
+  struct Program prog;
+  char regex[33*3 + 1];
+  int i, rc;
+
+  for(i = 0; i < 33; i++)
+    sprintf(regex + 3*i, "[%c]", i < 26 ? 'a' + i : 'A' + i - 26);
+  errno = 0;
+  rc = compile(&prog, regex, 0);
+  result("33 classes", "bytes", rc < 0 && errno == E2BIG);
+  if(rc == 0)
+    freeprogram(&prog);
+  rc = compile(&prog, regex, UTF8);
+  result("33 classes", "UTF8", rc == 0);
+  if(rc == 0)
+    freeprogram(&prog);
+}
+
+int
+main(void)
+{
+  checkscan();
+  checkscansteps();
+  checklimits();
+  checkclasses();
+  if(!failed)
+    printf("# All library tests passed.\n");
+  return failed;
+}
@@ -33,7 +33,7 @@
  * at most two instructions (see compiletree()); nodes that do not
  * correspond to characters in the original regex add none.
  * Therefore, an upper-bound on the program size is 2*N+6 for a regex
- * of size N (see compile()).
+ * of size N (see compile()), plus what Ranges need (see rangesize()).
  */
 enum { MIN_CODESIZE=6 };
 
@@ -43,8 +43,151 @@ struct Flags {
   int matchend;  /* match to end of string */
   int nextsave;  /* 0..MAX_SAVE for Save instructions */
   int nocase;    /* ignore the case of letters */
+  struct ByteSeq *seqs;  /* room for the largest Ranges (see utf8seqs()) */
 };
 
+/* Compiling takes memory from the heap, or from an arena if a is not
+ * NULL (see compileinto()).  In an arena, what the program keeps is
+ * taken from the bottom of the free space, and scratch from the top,
+ * all of which is given back once the program is compiled.  Memory
+ * from either comes zeroed.
+ */
+struct Mem {
+  struct Arena *a;
+  size_t top;  /* the offset of the scratch in use */
+};
+
+enum { ALIGN = sizeof(void*) };
+#define aligned(n)  (((n) + ALIGN-1) & ~(size_t)(ALIGN-1))
+
+static void*
+keep(struct Mem *mem, size_t n)
+{
+  struct Arena *a = mem->a;
+  size_t at;
+
+  if(a == NULL)
+    return calloc(1, n);
+  at = aligned(a->used);
+  if(at > mem->top || n > mem->top - at)
+    return NULL;
+  a->used = at + n;
+  return memset(a->base + at, 0, n);
+}
+
+static void*
+scratch(struct Mem *mem, size_t n)
+{
+  struct Arena *a = mem->a;
+  size_t at;
+
+  if(a == NULL)
+    return calloc(1, n);
+  if(n > mem->top)
+    return NULL;
+  at = (mem->top - n) & ~(size_t)(ALIGN-1);
+  if(at < aligned(a->used))
+    return NULL;
+  mem->top = at;
+  return memset(a->base + at, 0, n);
+}
+
+/* Give back p: from an arena, only what was kept last can be. */
+static void
+release(struct Mem *mem, void *p)
+{
+  struct Arena *a = mem->a;
+
+  if(a == NULL)
+    free(p);
+  else if((char*)p >= a->base && (char*)p < a->base + a->used)
+    a->used = (char*)p - a->base;
+}
+
+static void
+releaseast(struct Mem *mem, struct AST *t)
+{
+  if(mem->a)
+    freeranges(t);  /* the nodes are scratch */
+  else
+    freeast(t);
+}
+
+/* Ranges are compiled to an alternation of byte range sequences:
+ *     Split L1 L2
+ *     L1: ByteRange ... ByteRange
+ *         Jump END
+ *     L2: Split L3 L4
+ *     ...
+ *     END:
+ * which needs a Split and a Jump for each sequence but the last, and
+ * up to four ByteRange instructions for each sequence.
+ */
+static int
+rangesize(struct AST *t, int *maxseqs)
+{
+  int k;
+
+  switch(t->op) {
+  case Ranges:
+    k = utf8seqs(NULL, t->args.ranges.r, t->args.ranges.n);
+    if(k > *maxseqs) *maxseqs = k;
+    return 6*k + 1;
+  case Concat:
+  case Either:
+    return rangesize(t->args.next.x, maxseqs) +
+      rangesize(t->args.next.y, maxseqs);
+  case Optional:
+  case WeakOpt:
+  case Star:
+  case WeakStar:
+  case Plus:
+  case WeakPlus:
+  case Capture:
+    return rangesize(t->args.next.x, maxseqs);
+  default:
+    return 0;
+  }
+}
+
+static struct Inst*
+compileranges(struct Inst *pc, struct Flags *flags, struct AST *t)
+{
+  struct ByteSeq *seq = flags->seqs;
+  struct Inst *end;
+  int i, j, k;
+
+  k = utf8seqs(seq, t->args.ranges.r, t->args.ranges.n);
+  if(k == 0) {  /* an empty class: never match */
+    pc->opcode = ByteRange;
+    pc->args.chr.c   = 1;
+    pc->args.chr.alt = 0;
+    return pc + 1;
+  }
+  for(end = pc + 2*(k-1), i = 0; i < k; i++)
+    end += seq[i].n;
+  for(i = 0; i < k; i++) {
+    if(i < k-1) {
+      pc->opcode = Split;
+      pc->args.next.x = pc+1;
+      pc->args.next.y = pc+1 + seq[i].n + 1;
+      pc++;
+    }
+    for(j = 0; j < seq[i].n; j++, pc++) {
+      pc->opcode = ByteRange;
+      pc->args.chr.c   = seq[i].lo[j];
+      pc->args.chr.alt = seq[i].hi[j];
+    }
+    if(i < k-1) {
+      pc->opcode = Jump;
+      pc->args.next.x = end;
+      pc++;
+    }
+  }
+  assert(pc == end);
+  return pc;
+}
+
 static struct Inst*
 compiletree(struct Inst *pc, struct Flags *flags, struct AST *t)
 {
@@ -77,6 +220,9 @@ compiletree(struct Inst *pc, struct Flags *flags, struct AST *t)
       pc->args.set.charset = t->args.set.charset;
       pc++;
       goto done;
+    case Ranges:
+      pc = compileranges(pc, flags, t);
+      goto done;
     case Dollar:
       flags->matchend = 1;
       goto done;
@@ -155,41 +301,603 @@ compiletree(struct Inst *pc, struct Flags *flags, struct AST *t)
   return pc;
 }
 
+/* Move the code into a block of exactly size instructions.  Jump and
+ * Split refer to other instructions, so they must be moved too.  In
+ * an arena, the code was kept last, so it need only be cut short.
+ */
+static struct Inst*
+shrink(struct Mem *mem, struct Inst *code, int size)
+{
+  struct Inst *pc, *new;
+
+  if(mem->a) {
+    mem->a->used = (char*)(code + size) - mem->a->base;
+    return code;
+  }
+  new = malloc(size * sizeof *new);
+  if(new == NULL) return code;  /* keep the larger block */
+  memcpy(new, code, size * sizeof *new);
+  for(pc = new; pc < new + size; pc++) {
+    switch(pc->opcode) {
+    case Split:
+      pc->args.next.y = new + (pc->args.next.y - code);
+      /* no break */
+    case Jump:
+      pc->args.next.x = new + (pc->args.next.x - code);
+      break;
+    default:
+      break;
+    }
+  }
+  free(code);
+  return new;
+}
+
+/* Find the least and greatest number of bytes t can match (the
+ * greatest is -1 if there is no bound).
+ */
+static void
+lengths(struct AST *t, int *min, int *max)
+{
+  int xmin, xmax, ymin, ymax, n;
+
+  switch(t->op) {
+  case Onechar:
+  case Anychar:
+  case Charset:
+    *min = *max = 1;
+    break;
+  case Ranges:
+    n = t->args.ranges.n;
+    *min = n ? utf8len(t->args.ranges.r[0].lo) : 1;
+    *max = n ? utf8len(t->args.ranges.r[n-1].hi) : 1;
+    break;
+  case Dollar:
+  case Epsilon:
+    *min = *max = 0;
+    break;
+  case Concat:
+  case Either:
+    lengths(t->args.next.x, &xmin, &xmax);
+    lengths(t->args.next.y, &ymin, &ymax);
+    if(t->op == Concat) {
+      *min = xmin + ymin;
+      *max = xmax < 0 || ymax < 0 ? -1 : xmax + ymax;
+    } else {
+      *min = xmin < ymin ? xmin : ymin;
+      *max = xmax < 0 || ymax < 0 ? -1 : xmax > ymax ? xmax : ymax;
+    }
+    break;
+  case Optional:
+  case WeakOpt:
+  case Star:
+  case WeakStar:
+  case Plus:
+  case WeakPlus:
+    lengths(t->args.next.x, min, max);
+    if(t->op != Plus && t->op != WeakPlus)
+      *min = 0;
+    if(t->op != Optional && t->op != WeakOpt && *max != 0)
+      *max = -1;
+    break;
+  case Capture:
+    lengths(t->args.next.x, min, max);
+    break;
+  default:
+    abort();
+  }
+}
+
+/* If t matches only one string (with no captures but $0), copy it to
+ * buf and return its length; otherwise return -1.
+ */
+static int
+literal(struct AST *t, char *buf)
+{
+  int n, m;
+
+  switch(t->op) {
+  case Onechar:
+    *buf = t->args.c;
+    return 1;
+  case Epsilon:
+  case Dollar:
+    return 0;
+  case Concat:
+    if((n = literal(t->args.next.x, buf)) < 0) return -1;
+    if((m = literal(t->args.next.y, buf + n)) < 0) return -1;
+    return n + m;
+  default:
+    return -1;
+  }
+}
+
+/* Record what can be told about the matches of the tree t before
+ * running it: their least and greatest lengths, and whether they are
+ * all the same string.  The unanchored prefix (.*?) doesn't count.
+ */
+static int
+analyze(struct Program *prog, struct AST *t, size_t size, struct Mem *mem)
+{
+  int n;
+
+  if(!(prog->options & Anchored)) {
+    assert(t->op == Concat && t->args.next.x->op == WeakStar);
+    t = t->args.next.y;
+  }
+  lengths(t, &prog->minlen, &prog->maxlen);
+  prog->literal = NULL;
+  if(prog->options & IgnoreCase)
+    return 0;
+  if(t->op == Concat)  /* (Concat (Capture x) Dollar) */
+    t = t->args.next.x;
+  assert(t->op == Capture);
+  if((prog->literal = keep(mem, size + 1)) == NULL)
+    return (errno=ENOMEM, -1);
+  if((n = literal(t->args.next.x, prog->literal)) < 0) {
+    release(mem, prog->literal);
+    prog->literal = NULL;
+    return 0;
+  }
+  prog->literal[n] = '\0';
+  return 0;
+}
+
+/* Find the bytes that can begin a match, so that vm() can skip those
+ * that cannot when no threads are running but the start state's.
+ * The search starts after the unanchored prefix (.*?) added by
+ * parse(): Split, AnyChar and Jump.  If an empty match is possible
+ * (or the program is anchored), every byte counts, and prog->first is
+ * left NULL; otherwise, the program keeps a table of them.
+ */
+static void
+firstbytes(struct Program *prog, struct Mem *mem)
+{
+  struct Inst *pc, **stack;
+  unsigned char first[UCHAR_MAX+1];
+  char *seen;
+  int c, n = 0;
+
+  memset(first, 1, sizeof first);
+  prog->first = NULL;
+  prog->nfirst = UCHAR_MAX+1;
+  if(prog->options & Anchored)
+    return;
+  assert(prog->code[0].opcode == Split && prog->code[1].opcode == AnyChar);
+  stack = scratch(mem, prog->size * sizeof *stack);
+  seen  = scratch(mem, prog->size);
+  if(!stack || !seen) goto done;  /* no harm: every byte counts */
+  memset(first, 0, sizeof first);
+  stack[n++] = &prog->code[3];
+  seen[3] = 1;
+  while(n > 0) {
+    pc = stack[--n];
+    switch(pc->opcode) {
+    case CharAlt:
+      first[(unsigned char)pc->args.chr.alt] = 1;
+      /* no break */
+    case Char:
+      first[(unsigned char)pc->args.chr.c] = 1;
+      continue;
+    case CharSet:
+      for(c = 1; c <= UCHAR_MAX; c++)
+	if(pc->args.set.charset[c] & pc->args.set.mask)
+	  first[c] = 1;
+      continue;
+    case ByteRange:
+      for(c = pc->args.chr.c; c <= pc->args.chr.alt; c++)
+	first[c] = 1;
+      continue;
+    case AnyChar:
+    case Match:
+      memset(first, 1, sizeof first);
+      goto done;
+    case MatchEnd:
+      continue;  /* vm() never skips past the end */
+    case Split:
+      if(!seen[pc->args.next.y - prog->code]) {
+	seen[pc->args.next.y - prog->code] = 1;
+	stack[n++] = pc->args.next.y;
+      }
+      /* no break */
+    case Jump:
+      pc = pc->args.next.x;
+      break;
+    case Save:
+      pc++;
+      break;
+    }
+    if(!seen[pc - prog->code]) {
+      seen[pc - prog->code] = 1;
+      stack[n++] = pc;
+    }
+  }
+ done:
+  for(prog->nfirst = c = 0; c <= UCHAR_MAX; c++) {
+    if(first[c]) {
+      prog->nfirst++;
+      prog->firstc = c;
+    }
+  }
+  release(mem, stack);
+  release(mem, seen);
+  if(prog->nfirst > UCHAR_MAX)
+    return;
+  if((prog->first = keep(mem, sizeof first)) == NULL)
+    prog->nfirst = UCHAR_MAX+1;  /* no harm, as above */
+  else
+    memcpy(prog->first, first, sizeof first);
+}
+
+/* Move the classes' bits from the parser's workspace (see parse())
+ * to memory the program keeps, if any instruction needs them.
+ */
+static int
+keepclasses(struct Program *prog, struct Mem *mem)
+{
+  unsigned *set = prog->charset;
+  struct Inst *pc, *end = prog->code + prog->size;
+
+  prog->charset = NULL;
+  for(pc = prog->code; pc < end && pc->opcode != CharSet; pc++)
+    ;
+  if(pc == end)
+    return 0;  /* no classes */
+  if((prog->charset = keep(mem, (UCHAR_MAX+1) * sizeof *set)) == NULL)
+    return (errno=ENOMEM, -1);
+  memcpy(prog->charset, set, (UCHAR_MAX+1) * sizeof *set);
+  for(; pc < end; pc++)
+    if(pc->opcode == CharSet)
+      pc->args.set.charset = prog->charset;
+  return 0;
+}
+
+/* How deeply t nests groups and repetitions, from level, counting
+ * no further than max; concatenation and alternation add nothing.
+ */
+static int
+depth(struct AST *t, int level, int max)
+{
+  int d, most = level;
+
+  while(level <= max) {
+    switch(t->op) {
+    case Concat:
+    case Either:
+      if((d = depth(t->args.next.x, level, max)) > most)
+	most = d;
+      t = t->args.next.y;
+      break;
+    case Optional:
+    case WeakOpt:
+    case Star:
+    case WeakStar:
+    case Plus:
+    case WeakPlus:
+    case Capture:
+      level++;
+      t = t->args.next.x;
+      break;
+    default:
+      return level > most ? level : most;
+    }
+  }
+  return level;
+}
+
+/* The regex itself, inside the $0 Capture (and after the prefix) that
+ * parse() adds around it.
+ */
+static struct AST*
+body(struct AST *t)
+{
+  while(t->op == Concat && t->args.next.x->op != Capture)
+    t = t->args.next.y;
+  if(t->op == Concat)
+    t = t->args.next.x;
+  assert(t->op == Capture);
+  return t->args.next.x;
+}
+
 int
-compile(struct Program *prog, char *regex, int options)
+progcost(struct Program *prog)
 {
-  struct AST *t;
+  struct Inst *pc, *to[2], **stack;
+  int *seen;
+  int i, j, k, n, most = 0;
+
+  if(!prog || !prog->code || prog->size < 1)
+    return (errno=EINVAL, -1);
+  stack = malloc(prog->size * sizeof *stack);
+  seen  = calloc(prog->size, sizeof *seen);  /* i+1 if in closure i */
+  if(!stack || !seen) {
+    free(stack);
+    free(seen);
+    return (errno=ENOMEM, -1);
+  }
+  for(i = 0; i < prog->size; i++) {
+    if(i > 0 && prog->code[i-1].opcode > ByteRange)
+      continue;  /* no thread resumes here (see enum Opcode) */
+    stack[0] = &prog->code[i];
+    seen[i] = i+1;
+    for(n = 1, k = 0; n > 0; k++) {
+      pc = stack[--n];
+      j = 0;
+      switch(pc->opcode) {
+      case Split:
+	to[j++] = pc->args.next.y;
+	/* no break */
+      case Jump:
+	to[j++] = pc->args.next.x;
+	break;
+      case Save:
+	to[j++] = pc+1;
+	break;
+      default:
+	break;
+      }
+      while(j-- > 0) {
+	if(seen[to[j] - prog->code] != i+1) {
+	  seen[to[j] - prog->code] = i+1;
+	  stack[n++] = to[j];
+	}
+      }
+    }
+    if(k > most) most = k;
+  }
+  free(stack);
+  free(seen);
+  return most;
+}
+
+static int
+build(struct Program *prog, char *regex, int options,
+      struct Limits *limits, struct Mem *mem)
+{
+  struct AST *t, *nodes = NULL;
   struct Inst *pc;
   struct Flags flags = {0};
+  unsigned charset[UCHAR_MAX+1];
   size_t max;
-  int rc;
+  int rc, cost, maxseqs = 0;
 
   if(!prog || !regex)
     return (errno=EINVAL, -1);
   prog->options = options;
-  rc = parse(&t, prog, regex);
-  if(rc) return rc;
+  prog->dfa = NULL;
+  prog->stats = NULL;
+  prog->limits = limits;
+  prog->literal = NULL;
+  prog->first = NULL;
+  prog->charset = charset;  /* until keepclasses() */
   max = 2*strlen(regex) + MIN_CODESIZE;
-  prog->code = calloc(max, sizeof *prog->code);
-  if(prog->code == NULL) {
-    free(t);
+  if(limits && limits->maxsize && max > (size_t)limits->maxsize)
+    return (errno=E2BIG, -1);  /* before anything is allocated */
+  if(mem->a && (nodes = scratch(mem, treesize(regex) * sizeof *t)) == NULL)
+    return (errno=ENOMEM, -1);
+  rc = parseinto(&t, nodes, prog, regex);
+  if(rc) return rc;
+  if(limits && limits->maxdepth &&
+     depth(body(t), 0, limits->maxdepth) > limits->maxdepth) {
+    releaseast(mem, t);
+    return (errno=E2BIG, -1);
+  }
+  max += rangesize(t, &maxseqs);
+  if(limits && limits->maxsize && max > (size_t)limits->maxsize) {
+    releaseast(mem, t);
+    return (errno=E2BIG, -1);
+  }
+  prog->code = keep(mem, max * sizeof *prog->code);
+  if(maxseqs > 0)
+    flags.seqs = scratch(mem, maxseqs * sizeof *flags.seqs);
+  if(prog->code == NULL || (maxseqs > 0 && flags.seqs == NULL)) {
+    release(mem, flags.seqs);
+    release(mem, prog->code);
+    releaseast(mem, t);
     return (errno=ENOMEM, -1);
   }
   flags.nocase = !!(options & IgnoreCase);
   pc = compiletree(prog->code, &flags, t);
   pc->opcode = flags.matchend ? MatchEnd : Match;
   pc++;
+  release(mem, flags.seqs);
   prog->size = pc - prog->code;
   assert(prog->size <= max);
-  pc = realloc(prog->code, prog->size * sizeof *prog->code);
-  if(pc) prog->code = pc;
-  free(t);
-  return 0;
+  prog->code = shrink(mem, prog->code, prog->size);
+  if((rc = keepclasses(prog, mem)) == 0) {
+    firstbytes(prog, mem);
+    rc = analyze(prog, t, strlen(regex), mem);
+  }
+  releaseast(mem, t);
+  if(rc == 0 && limits && limits->maxcost) {
+    if((cost = progcost(prog)) < 0)
+      rc = -1;
+    else if(cost > limits->maxcost)
+      rc = (errno=E2BIG, -1);
+  }
+  if(rc == 0 && (options & BuildDFA))
+    rc = builddfa(prog, 0);
+  if(rc) freeprogram(prog);
+  return rc;
+}
+
+int
+compile(struct Program *prog, char *regex, int options)
+{
+  struct Mem heap = {0};
+
+  return build(prog, regex, options & ~(InArena|Compact), NULL, &heap);
+}
+
+int
+compilelimited(struct Program *prog, char *regex, int options,
+	       struct Limits *limits)
+{
+  struct Mem heap = {0};
+
+  return build(prog, regex, options & ~(InArena|Compact), limits, &heap);
+}
+
+int
+compileinto(struct Program *prog, char *regex, int options,
+	    struct Arena *arena)
+{
+  struct Mem mem;
+  size_t used;
+  int rc;
+
+  if(!arena || !arena->base || arena->used > arena->size)
+    return (errno=EINVAL, -1);
+  mem.a = arena;
+  mem.top = arena->size;
+  used = arena->used;
+  rc = build(prog, regex, (options & ~Compact) | InArena, NULL, &mem);
+  if(rc) arena->used = used;
+  return rc;
+}
+
+/* The room compileinto() takes at most: the code at its largest, the
+ * literal and the tables, kept, and the tree, byte sequences and
+ * firstbytes()'s stacks as scratch, with room to align each.  Only
+ * with UTF8 need the regex be parsed, for rangesize().
+ */
+size_t
+arenasize(char *regex, int options)
+{
+  struct Program prog;
+  struct AST *t;
+  unsigned charset[UCHAR_MAX+1];
+  size_t n, max;
+  int maxseqs = 0;
+
+  if(!regex)
+    return (errno=EINVAL, 0);
+  n = strlen(regex);
+  max = 2*n + MIN_CODESIZE;
+  if(options & UTF8) {
+    prog.options = options;
+    prog.limits = NULL;
+    prog.charset = charset;
+    if(parse(&t, &prog, regex))
+      return 0;
+    max += rangesize(t, &maxseqs);
+    freeast(t);
+  }
+  return aligned(max * sizeof(struct Inst)) + aligned(n + 1) +
+    aligned(sizeof charset) + aligned(UCHAR_MAX+1) +
+    aligned(treesize(regex) * sizeof(struct AST)) +
+    aligned(maxseqs * sizeof(struct ByteSeq)) +
+    aligned(max * sizeof(struct Inst*)) + aligned(max) + 2*ALIGN;
+}
+
+/* The rules are compiled as an alternation, each with its own Match:
+ *     Split L1 L2
+ *     L1: rule 1
+ *         Match id1
+ *     L2: Split L3 L4
+ *     ...
+ * The program is anchored, so it has no prefix.
+ */
+int
+compilerules(struct Program *prog, struct Rule *rules, int n, int options)
+{
+  struct AST **trees;
+  struct Inst *pc, *split;
+  struct Flags flags;
+  struct Mem heap = {0};
+  unsigned charset[UCHAR_MAX+1];
+  size_t max = 0;
+  int i, rc = 0, min, maxlen, maxseqs = 0;
+
+  if(!prog || !rules || n < 1)
+    return (errno=EINVAL, -1);
+  if((trees = calloc(n, sizeof *trees)) == NULL)
+    return (errno=ENOMEM, -1);
+  prog->options = (options & (IgnoreCase|UTF8)) | Anchored;
+  prog->dfa = NULL;
+  prog->stats = NULL;
+  prog->limits = NULL;
+  prog->literal = NULL;
+  prog->code = NULL;
+  prog->first = NULL;
+  prog->charset = charset;  /* until keepclasses() */
+  memset(charset, 0, sizeof charset);
+  prog->charset[0] = 1;  /* the next bit to use (see parsemore()) */
+  for(i = 0; i < n && rc == 0; i++) {
+    if(!rules[i].regex) {
+      rc = (errno=EINVAL, -1);
+      break;
+    }
+    if((rc = parsemore(&trees[i], prog, rules[i].regex)) == 0)
+      max += 2*strlen(rules[i].regex) + MIN_CODESIZE +
+	rangesize(trees[i], &maxseqs);
+  }
+  prog->charset[0] = 0;  /* we never match NULs */
+  prog->options &= ~AnchoredEnd;  /* that was up to each rule */
+  memset(&flags, 0, sizeof flags);
+  if(rc == 0) {
+    prog->code = calloc(max, sizeof *prog->code);
+    if(maxseqs > 0)
+      flags.seqs = malloc(maxseqs * sizeof *flags.seqs);
+    if(prog->code == NULL || (maxseqs > 0 && flags.seqs == NULL))
+      rc = (errno=ENOMEM, -1);
+  }
+  if(rc == 0) {
+    pc = prog->code;
+    prog->minlen = INT_MAX;
+    prog->maxlen = 0;
+    for(i = 0; i < n; i++) {
+      split = NULL;
+      if(i < n-1)
+	split = pc++;
+      flags.matchend = flags.nextsave = 0;
+      flags.nocase = !!(options & IgnoreCase);
+      pc = compiletree(pc, &flags, trees[i]);
+      pc->opcode = flags.matchend ? MatchEnd : Match;
+      pc->args.i = rules[i].id;
+      pc++;
+      if(split) {
+	split->opcode = Split;
+	split->args.next.x = split+1;
+	split->args.next.y = pc;
+      }
+      lengths(trees[i], &min, &maxlen);
+      if(min < prog->minlen) prog->minlen = min;
+      if(prog->maxlen >= 0 && (maxlen < 0 || maxlen > prog->maxlen))
+	prog->maxlen = maxlen;
+    }
+    prog->size = pc - prog->code;
+    assert(prog->size <= max);
+    prog->code = shrink(&heap, prog->code, prog->size);
+    if((rc = keepclasses(prog, &heap)) == 0)
+      firstbytes(prog, &heap);
+  }
+  if(rc) {
+    free(prog->code);
+    prog->code = NULL;
+    prog->charset = NULL;
+  }
+  free(flags.seqs);
+  for(i = 0; i < n; i++)
+    freeast(trees[i]);
+  free(trees);
+  return rc;
 }
 
 void
 freeprogram(struct Program *prog)
 {
-  free(prog->code);
+  freedfa(prog);
+  if(prog->options & Compact) {
+    free(prog->code);  /* and the literal after it (see compact()) */
+  } else if(!(prog->options & InArena)) {  /* else it's the arena's */
+    free(prog->code);
+    free(prog->literal);
+    free(prog->charset);
+    free(prog->first);
+  }
   prog->code = NULL;
+  prog->literal = NULL;
+  prog->charset = NULL;
+  prog->first = NULL;
 }
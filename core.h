@@ -16,6 +16,7 @@
  */
 
 #include <limits.h>
+#include <stddef.h>
 
 /* Opcodes (Inst.opcode) */
 enum Opcode {
@@ -23,6 +24,7 @@ enum Opcode {
   Char,      /* die unless next char is chr.c */
   AnyChar,   /* accept the current character */
   CharSet,   /* die unless charset[next_char] & mask */
+  ByteRange, /* die unless chr.c <= next byte <= chr.alt (see UTF8) */
   Match,     /* regex match successful */
   MatchEnd,  /* regex match if at end of string */
   Jump,      /* jump to x */
@@ -52,6 +54,7 @@ enum Op {
   Onechar,  /* c   - match the character c */
   Anychar,  /* .   - match any character */
   Charset,  /* []  - match if charset[next_char] & mask */
+  Ranges,   /* [] . - match a code point in one of the ranges (UTF8) */
   Dollar,   /* $   - match the end of a string */
   Epsilon,  /*     - match nothing (the empty string) */
   Concat,   /* xy  - match x then y */
@@ -65,6 +68,16 @@ enum Op {
   Capture   /* (x) - match x, and make note of its start/end */
 };
 
+/* Code Point Ranges (see utf8.c) */
+struct Range {
+  int lo, hi;
+};
+
+struct RangeList {
+  struct Range *r;
+  int n, max;
+};
+
 /* Abstract Syntax Tree */
 struct AST
 {
@@ -74,37 +87,259 @@ struct AST
     struct {
       unsigned mask, *charset;
     } set;
+    struct {
+      int n;
+      struct Range *r;  /* sorted, disjoint and not adjacent */
+    } ranges;
     struct {
       struct AST *x, *y;
     } next;
   } args;
 };
 
+/* Deterministic Automaton (see builddfa())
+ *
+ * Bytes are first mapped to equivalence classes (classes[byte]); the
+ * next state is then trans[state*nclasses + class].  State 0 is the
+ * dead state, from which no match is possible.
+ */
+struct DFA {
+  int nstates, nclasses, start;
+  unsigned char classes[UCHAR_MAX+1];
+  unsigned char *accept;  /* per state: DFAMatch and DFAMatchEnd bits */
+  int *trans;             /* nstates * nclasses transitions */
+};
+
+enum DFAFlags {  /* bits (DFA.accept) */
+  DFAMatch    = 1,  /* the state contains a Match */
+  DFAMatchEnd = 2   /* the state contains a MatchEnd */
+};
+
+/* Execution Statistics (see initstats())
+ *
+ * When built with -DVM_STATS, vm() adds to the counters in
+ * prog->stats unless it is NULL; otherwise they are compiled out.
+ * The counters are not shared safely, so a program counting into
+ * stats must be matched from one thread at a time.
+ */
+struct Stats {
+  unsigned long calls;    /* vm() calls */
+  unsigned long bytes;    /* input bytes scanned by threads */
+  unsigned long threads;  /* threads added to a list */
+  unsigned long steps;    /* epsilon steps: Jump, Split and Save */
+  unsigned long allocs;   /* memory allocations */
+  int maxthreads;         /* the most threads in a list at once */
+  unsigned long *hits;    /* times each instruction was executed */
+};
+
 struct Program {
   struct Inst *code;
+  struct DFA *dfa;      /* NULL unless built (see builddfa()) */
+  struct Stats *stats;  /* NULL unless counting (see initstats()) */
+  struct Limits *limits;  /* NULL unless limited (see compilelimited()) */
   int options, size;
-  unsigned charset[UCHAR_MAX];
+  int minlen, maxlen;  /* bytes in any match (maxlen is -1 if unbounded) */
+  char *literal;       /* the one string matched, if it is just that */
+  int nfirst;  /* how many bytes can begin a match (see firstbytes()) */
+  int firstc;  /* the byte that can, when nfirst is 1 */
+  unsigned char *first;  /* can byte c begin a match? (NULL if all can) */
+  unsigned *charset;     /* the classes' bits (NULL if none; see parse()) */
 };
 
 enum Options {  /* bits */
-  IgnoreCase = 1
+  IgnoreCase    = 1,
+  BuildDFA      = 2,  /* see builddfa() */
+  Earliest      = 4,  /* stop at the first match found (see vm()) */
+  LeftmostFirst = 8,  /* prefer the match found first, not the longest */
+  Anchored      = 16, /* match only at the start (set by a leading ^) */
+  AnchoredEnd   = 32, /* match only at the end (set by a trailing $) */
+  UTF8          = 64, /* match characters, not bytes (see utf8.c) */
+  InArena       = 128, /* the code is in an arena (set by compileinto()) */
+  Compact       = 256  /* the tables are in a bank (set by compact()) */
 };
 
+enum { DFA_MEMLIMIT = 1<<20 };  /* default limit for builddfa() */
+
 /* parse(*ast, prog, regex)
  *
  * Create the abstract syntax tree (AST) for a new program and the
  * given regex.  When the regex is successfully parsed, *ast will be
- * assigned the AST.
+ * assigned the AST.  The classes' bits are set in prog->charset,
+ * which must have room for UCHAR_MAX+1 of them.
  */
 int parse(struct AST **ast, struct Program *prog, char *regex);
+void freeast(struct AST *ast);
+
+/* parseinto(*ast, nodes, prog, regex)
+ *
+ * As parse(), but build the tree in nodes (if not NULL), which must
+ * have room for treesize(regex) of them and belong to the caller; the
+ * tree is then released with freeranges() instead of freeast().
+ */
+int parseinto(struct AST **ast, struct AST *nodes, struct Program *prog,
+	      char *regex);
+size_t treesize(char *regex);
+void freeranges(struct AST *ast);
+
+/* parsemore(*ast, prog, regex)
+ *
+ * As parse(), but for another regex of the same program: classes are
+ * added to prog->charset rather than replacing it.  The caller sets
+ * prog->charset[0] to the first class bit to use (1 for the first
+ * regex), and clears it when done (see compilerules()).
+ */
+int parsemore(struct AST **ast, struct Program *prog, char *regex);
 
 /* compile(prog, regex)
  *
- * Compile a regular expression (regex) into a program (prog).
+ * Compile a regular expression (regex) into a program (prog).  With
+ * UTF8, the regex and the input are taken to be UTF-8: ., [] and
+ * IgnoreCase match whole characters, which are compiled to sequences
+ * of ByteRange instructions, so vm() and the DFA still see bytes.  A
+ * regex that is not valid UTF-8 fails with EILSEQ.  Without UTF8, a
+ * regex may have at most 32 different [] classes (identical ones share
+ * one); more fail with E2BIG.
  */
 int compile(struct Program *prog, char *regex, int options);
 void freeprogram(struct Program *prog);
 
+/* Compile Limits (see compilelimited())
+ *
+ * For regexes from untrusted sources.  A limit of 0 is no limit.
+ */
+struct Limits {
+  int maxsize;     /* instructions the program may need */
+  int maxclasses;  /* [] classes in the regex */
+  int maxdepth;    /* nesting of groups and repetitions */
+  int maxcost;     /* the largest epsilon closure (see progcost()) */
+  unsigned long maxsteps;  /* threads run by one search (see vm()) */
+};
+
+/* compilelimited(prog, regex, options, limits)
+ *
+ * As compile(), but fail with E2BIG if the regex or its program goes
+ * beyond any of the limits.  maxsize is checked before any code is
+ * laid out, against the most the regex could need: two instructions
+ * per byte, a few more, and the byte sequences of any UTF-8 ranges.
+ * The program keeps a pointer to limits (which may be NULL), so that
+ * vm() and scan() can enforce maxsteps.
+ */
+int compilelimited(struct Program *prog, char *regex, int options,
+		   struct Limits *limits);
+
+/* Compile Arenas (see compileinto())
+ *
+ * Programs are laid out one after another from base, and used is how
+ * far they reach.  base must be aligned as malloc() would align it.
+ */
+struct Arena {
+  char *base;
+  size_t size, used;
+};
+
+/* compileinto(prog, regex, options, arena)
+ *
+ * As compile(), but take the program's code and literal from the
+ * arena, in one block, and the tree and other scratch from the free
+ * space above it; nothing comes from the heap unless a DFA is built or
+ * a UTF8 regex has classes.  freeprogram() leaves the block in the
+ * arena, so that all the programs compiled into one arena are freed
+ * with it.  Fails with ENOMEM if the arena has too little room, which
+ * arenasize(regex, options) gives for one regex (or 0 on error with
+ * errno set); the sum of those is enough room to compile several.
+ */
+int compileinto(struct Program *prog, char *regex, int options,
+		struct Arena *arena);
+size_t arenasize(char *regex, int options);
+
+/* Shared Tables (see compact())
+ *
+ * Class bitmaps are stored in blocks of UCHAR_MAX+1 words, each class
+ * a bit, so that a CharSet instruction can point into a block as it
+ * would into prog->charset.  Both they and first-byte tables (see
+ * firstbytes()) are interned: each distinct one is stored once, for
+ * all the programs that need it.  A zeroed Bank is empty.
+ */
+struct Bank {
+  void *entries;      /* a hash table of the tables stored (see bank.c) */
+  int n, max;         /* how many are stored, and room for them */
+  unsigned *block;    /* the block being filled, or NULL */
+  unsigned nextbit;   /* the next bit free in it, or 0 if full */
+  size_t bytes;       /* the memory the bank holds */
+};
+
+/* compact(prog, bank), progsize(prog)
+ *
+ * Move a compiled program's tables into the bank, and its code and
+ * literal into one block of their own, to hold as little memory as
+ * large numbers of programs can.  Matching is unchanged.  Compact a
+ * program before giving it to initmatcher(); free the bank only after
+ * all its programs.  Returns 0, or -1 with errno set appropriately.
+ *
+ * progsize() returns the bytes a program holds (but not those it
+ * shares through a bank): the Program itself, its code and literal,
+ * its own tables and its DFA.
+ */
+int compact(struct Program *prog, struct Bank *bank);
+void freebank(struct Bank *bank);
+size_t progsize(struct Program *prog);
+
+/* progcost(prog)
+ *
+ * Estimate what each byte of input costs vm(): the size of the
+ * largest epsilon closure, that is, the most instructions visited
+ * when adding one thread that has consumed a byte (or the first).
+ * This takes time quadratic in prog->size at worst.  Returns -1 on
+ * error with errno set appropriately.
+ */
+int progcost(struct Program *prog);
+
+/* Scanner Rules (see compilerules()) */
+struct Rule {
+  char *regex;
+  int id;  /* the token returned by scan() */
+};
+
+/* compilerules(prog, rules, n, options)
+ *
+ * Compile n rules into one anchored program for scan(), each rule
+ * ending in a Match (or MatchEnd) whose args.i is the rule's id.  Of
+ * the options, only IgnoreCase and UTF8 apply.  The rules share the
+ * program's classes, so without UTF8, they may have at most 32
+ * different [] classes between them (see compile()).  The program
+ * has no limits; prog->limits may be set afterwards for maxsteps.
+ */
+int compilerules(struct Program *prog, struct Rule *rules, int n,
+		 int options);
+
+/* builddfa(prog, limit)
+ *
+ * Build a minimal DFA for prog by subset construction over its
+ * instructions, followed by Hopcroft's minimization over byte
+ * classes.  If the construction (with the minimization's working
+ * space) needs more than limit bytes (or DFA_MEMLIMIT if limit is 0),
+ * prog->dfa is left NULL and vm() keeps using the instructions alone.
+ * Returns 0, or -1 on error with errno set appropriately.
+ */
+int builddfa(struct Program *prog, size_t limit);
+void freedfa(struct Program *prog);
+
+/* dfaexec(dfa, input)
+ *
+ * Returns 1 if input contains a match, else 0.  Captures are not
+ * recorded; vm() uses this to reject input before running threads.
+ */
+int dfaexec(struct DFA *dfa, char *input);
+
+/* dfabatch(dfa, inputs, lens, n, results)
+ *
+ * As dfaexec() for each of n inputs (of lens[i] bytes, or up to the
+ * NUL if lens is NULL), storing each answer in results[i].  Several
+ * inputs are run at once, interleaved; see matchbatch().
+ */
+int dfabatch(struct DFA *dfa, char **inputs, size_t *lens, int n,
+	     int *results);
+
 /* vm(prog, input, saved)
  *
  * Execute compiled regex (prog) on input string (input).  If
@@ -112,5 +347,151 @@ void freeprogram(struct Program *prog);
  * every position recorded by a Save instruction (unused entries will
  * be set NULL).  If no match is found, 0 is returned.  On error, -1
  * is returned and errno is set appropriately.
+ *
+ * Of the matches starting leftmost, the longest is found, unless the
+ * program was compiled with LeftmostFirst (then the one preferred by
+ * ?, * and + is found) or Earliest (then the first to end is found,
+ * and vm() returns as soon as it is).
+ *
+ * If the program has a limit on steps (see compilelimited()), a search
+ * that runs more threads than that fails with ETIME.
  */
 int vm(struct Program *prog, char *input, char **saved);
+
+/* matchbatch(prog, inputs, n, results)
+ *
+ * Find whether each of n inputs (NUL-terminated) contains a match,
+ * storing 1 or 0 in results[i] (no captures are recorded).  With a
+ * DFA, several inputs are advanced through it in lockstep (see
+ * dfabatch()); otherwise, one set of thread lists serves the whole
+ * batch.  Like vm(), it leaves prog untouched (unless it counts
+ * statistics; see initstats()), so other threads may match with
+ * prog meanwhile.  Returns 0, or -1 on error (such as ETIME; see
+ * vm()) with errno set appropriately.
+ */
+int matchbatch(struct Program *prog, char **inputs, int n, int *results);
+
+/* Match Iterator (see nextmatch()) */
+struct Matcher {
+  struct Program *prog;
+  char *input;      /* as given to setinput() */
+  char *sp;         /* where to search next, or NULL when done */
+  char *last;       /* where the last match ended */
+  char *saved[20];  /* positions recorded by the last match */
+  void *lists;      /* thread lists, kept from one search to the next */
+};
+
+/* initmatcher(m, prog), setinput(m, input), nextmatch(m)
+ *
+ * Find every match of prog in input, in order.  Each call to
+ * nextmatch() continues from the end of the last match, reusing the
+ * matcher's thread lists; it returns 1 and fills m->saved (as vm()
+ * fills saved) until no more matches are found, then 0.  An empty
+ * match right after the end of the last match is skipped.  One
+ * matcher can be given any number of inputs in turn.  On error,
+ * initmatcher() and nextmatch() return -1 and set errno appropriately
+ * (nextmatch() then finds no more matches).
+ */
+int initmatcher(struct Matcher *m, struct Program *prog);
+void setinput(struct Matcher *m, char *input);
+int nextmatch(struct Matcher *m);
+void freematcher(struct Matcher *m);
+
+/* anymatch(m, input)
+ *
+ * Find whether input contains a match, without finding where, for a
+ * caller that needs no captures.  With a DFA, it alone answers (vm()
+ * and nextmatch() must run threads after it for the captures);
+ * otherwise the threads stop at the first match found, as with
+ * Earliest.  Returns 1 or 0, or -1 on error with errno set.  The
+ * matcher's input is left as it was.
+ */
+int anymatch(struct Matcher *m, char *input);
+
+/* Replacement Templates (see parsetemplate())
+ *
+ * A template is split into pieces, each either literal text or a
+ * capture; a piece with neither ends the template.
+ */
+struct Piece {
+  char *text;   /* literal text (pointing into the template), or NULL */
+  int len;      /* the length of text */
+  int capture;  /* the capture to substitute (0-9), or -1 */
+};
+
+/* parsetemplate(tmpl)
+ *
+ * Split a template into pieces: "$N" stands for capture N, "$$" for
+ * "$", and any other text stands for itself.  The pieces point into
+ * tmpl, which must outlive them; free() them when done.  Returns NULL
+ * on error with errno set appropriately.
+ */
+struct Piece *parsetemplate(char *tmpl);
+
+/* expand(tmpl, saved, emit, arg)
+ *
+ * Pass each piece of tmpl to emit(arg, s, len) in turn, captures taken
+ * from saved (as filled by vm()); nothing is copied.  Returns 0, or -1
+ * as soon as emit() returns nonzero.
+ */
+int expand(struct Piece *tmpl, char **saved,
+	   int (*emit)(void *arg, char *s, size_t len), void *arg);
+
+/* substitute(m, input, tmpl, all, emit, arg)
+ *
+ * Replace the first match of m->prog in input (or, if all is nonzero,
+ * every match found by nextmatch()) with tmpl, passing the result to
+ * emit() as spans of input and of expand()'s pieces.  The span before
+ * each match is always emitted, even if empty; when nothing matches,
+ * nothing is emitted.  Returns the number of matches replaced, or -1
+ * on error (including emit() returning nonzero).
+ */
+int substitute(struct Matcher *m, char *input, struct Piece *tmpl, int all,
+	       int (*emit)(void *arg, char *s, size_t len), void *arg);
+
+/* scan(m, sp, end, id)
+ *
+ * Find the longest token at sp, using the matcher's thread lists (m
+ * must have been set up with a program from compilerules()).  When
+ * several rules match the longest token, the one listed first wins.
+ * Returns 1, setting *end past the token and *id to the rule's id, or
+ * 0 if no rule matches at sp.  On error, -1 is returned and errno is
+ * set appropriately.  As in vm(), a program with a limit on steps
+ * fails with ETIME once the threads run past it.
+ */
+int scan(struct Matcher *m, char *sp, char **end, int *id);
+
+/* initstats(stats, prog)
+ *
+ * Zero the counters and allocate stats->hits for each instruction in
+ * prog, then have prog count into stats; from then on, prog is written
+ * while matching (see struct Stats).  Returns 0, or -1 with errno set
+ * to ENOSYS if statistics were not compiled in.
+ */
+int initstats(struct Stats *stats, struct Program *prog);
+void freestats(struct Stats *stats);
+
+/* UTF-8 Routines
+ *
+ * utf8decode() returns the character at *ref and moves *ref past it,
+ * or returns -1 with errno set to EILSEQ.  casefold() stores every
+ * case of c (c first) in cases[4] and returns how many there are.
+ * The RangeList routines return -1 with errno set to ENOMEM on error.
+ * utf8seqs() splits the ranges into sequences of byte ranges that
+ * together match their UTF-8 encodings, and returns how many (seqs
+ * may be NULL to only count them).
+ */
+struct ByteSeq {
+  int n;  /* 1 to 4 bytes */
+  unsigned char lo[4], hi[4];
+};
+
+int utf8decode(char **ref);
+int utf8encode(char *buf, int c);
+int utf8len(int c);
+int casefold(int c, int *cases);
+int addrange(struct RangeList *l, int lo, int hi);
+void normranges(struct RangeList *l);
+int foldranges(struct RangeList *l);
+int negateranges(struct RangeList *l);
+int utf8seqs(struct ByteSeq *seqs, struct Range *r, int n);
@@ -15,6 +15,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <ctype.h>
 #include <errno.h>
 #include <stdlib.h>
 #include "core.h"
@@ -47,7 +48,7 @@ charset(char *buf, struct Inst *pc)
   }
   if((set[']'] & mask) == marked)
     *s++ = ']';
-  for(c=1; c < UCHAR_MAX; c++) {
+  for(c=1; c <= UCHAR_MAX; c++) {
     if((set[c] & mask) != marked || c == ']')
       continue;
     else if(last && last < c-1) {
@@ -63,11 +64,43 @@ charset(char *buf, struct Inst *pc)
   return buf;
 }
 
+/* Format the bytes that can begin a match (see firstbytes()). */
+static char*
+firstset(char *buf, struct Program *prog)
+{
+  int c, first=0, last=0;
+  char *s = buf;
+
+  for(c=1; c <= UCHAR_MAX; c++) {
+    if(!prog->first[c])
+      continue;
+    else if(last && last < c-1) {
+      s = range(s, first, last);
+      first = last = c;
+    } else {
+      last = c;
+      if(!first) first = c;
+    }
+  }
+  if(last) s = range(s, first, last);
+  *s = '\0';
+  return buf;
+}
+
+static void
+printbyte(FILE *stream, int c)
+{
+  if(isgraph(c) && c != '\\')
+    putc(c, stream);
+  else
+    fprintf(stream, "\\x%02x", c);
+}
+
 int
 printprogram(FILE *stream, struct Program *prog)
 {
   struct Inst *pc0, *pc;
-  char buf[UCHAR_MAX];
+  char buf[UCHAR_MAX+4];
   int i;
 
   if(stream == NULL || prog == NULL || prog->size < 1)
@@ -76,6 +109,8 @@ printprogram(FILE *stream, struct Program *prog)
   for(i = 0; i < prog->size; i++) {
     pc = &prog->code[i];
     fprintf(stream, "%03d ", (int)(pc - pc0));
+    if(prog->stats && prog->stats->hits)
+      fprintf(stream, "%10lu ", prog->stats->hits[i]);
     switch(pc->opcode) {
     case CharAlt:
       fprintf(stream, "CharAlt %c %c\n", pc->args.chr.c, pc->args.chr.alt);
@@ -83,6 +118,13 @@ printprogram(FILE *stream, struct Program *prog)
     case Char:
       fprintf(stream, "Char %c\n", pc->args.chr.c);
       break;
+    case ByteRange:
+      fprintf(stream, "ByteRange ");
+      printbyte(stream, pc->args.chr.c);
+      putc('-', stream);
+      printbyte(stream, pc->args.chr.alt);
+      putc('\n', stream);
+      break;
     case AnyChar:
       fprintf(stream, "AnyChar\n");
       break;
@@ -90,10 +132,11 @@ printprogram(FILE *stream, struct Program *prog)
       fprintf(stream, "CharSet [%s]\n", charset(buf, pc));
       break;
     case Match:
-      fprintf(stream, "Match\n");
-      break;
     case MatchEnd:
-      fprintf(stream, "MatchEnd\n");
+      fprintf(stream, pc->opcode == Match ? "Match" : "MatchEnd");
+      if(pc->args.i)  /* a token (see compilerules()) */
+	fprintf(stream, " %d", pc->args.i);
+      putc('\n', stream);
       break;
     case Jump:
       fprintf(stream, "Jump %03d\n", (int)(pc->args.next.x - pc0));
@@ -110,5 +153,65 @@ printprogram(FILE *stream, struct Program *prog)
       abort();
     }
   }
+  if(prog->nfirst <= UCHAR_MAX)
+    fprintf(stream, "First [%s]\n", firstset(buf, prog));
+  fprintf(stream, "Length %d", prog->minlen);
+  if(prog->maxlen != prog->minlen)
+    fprintf(stream, prog->maxlen < 0 ? "+" : "-%d", prog->maxlen);
+  fprintf(stream, "%s%s\n", prog->options & Anchored ? " ^" : "",
+	  prog->options & AnchoredEnd ? " $" : "");
+  if(prog->literal)
+    fprintf(stream, "Literal %s\n", prog->literal);
+  return 0;
+}
+
+int
+printstats(FILE *stream, struct Stats *stats)
+{
+  if(stream == NULL || stats == NULL)
+    return (errno=EINVAL, -1);
+  fprintf(stream, "calls      %lu\n", stats->calls);
+  fprintf(stream, "bytes      %lu\n", stats->bytes);
+  fprintf(stream, "threads    %lu\n", stats->threads);
+  fprintf(stream, "steps      %lu\n", stats->steps);
+  fprintf(stream, "maxthreads %d\n",  stats->maxthreads);
+  fprintf(stream, "allocs     %lu\n", stats->allocs);
+  return 0;
+}
+
+int
+printdfa(FILE *stream, struct Program *prog)
+{
+  struct DFA *d;
+  int c, first, k, s;
+
+  if(stream == NULL || prog == NULL || prog->dfa == NULL)
+    return (errno=EINVAL, -1);
+  d = prog->dfa;
+  fprintf(stream, "DFA %d states, %d classes, start %03d\n",
+	  d->nstates, d->nclasses, d->start);
+  for(k = 0; k < d->nclasses; k++) {
+    fprintf(stream, "class %d:", k);
+    for(c = 0; c <= UCHAR_MAX; c++) {
+      if(d->classes[c] != k) continue;
+      for(first = c; c < UCHAR_MAX && d->classes[c+1] == k; c++)
+	;
+      putc(' ', stream);
+      printbyte(stream, first);
+      if(c > first) {
+	putc('-', stream);
+	printbyte(stream, c);
+      }
+    }
+    putc('\n', stream);
+  }
+  for(s = 0; s < d->nstates; s++) {
+    fprintf(stream, "%03d %c%c", s,
+	    d->accept[s] & DFAMatch    ? 'M' : '.',
+	    d->accept[s] & DFAMatchEnd ? '$' : '.');
+    for(k = 0; k < d->nclasses; k++)
+      fprintf(stream, " %03d", d->trans[s*d->nclasses + k]);
+    putc('\n', stream);
+  }
   return 0;
 }
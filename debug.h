@@ -17,4 +17,15 @@
 
 #include <stdio.h>
 
+/* Print the program's instructions, one per line.  If prog->stats is
+ * set, each is preceded by the number of times it was executed.
+ */
 int printprogram(FILE *stream, struct Program *prog);
+
+/* Print the totals counted in stats, one per line. */
+int printstats(FILE *stream, struct Stats *stats);
+
+/* Print the DFA's byte classes, then one line per state: its accept
+ * flags (M for Match, $ for MatchEnd) and its transitions by class.
+ */
+int printdfa(FILE *stream, struct Program *prog);
@@ -0,0 +1,561 @@
+/* A Regular Expression Library - Deterministic Automata
+ * Copyright (c) 2012 Eric Mulvaney
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "core.h"
+
+/* During subset construction, each DFA state is named by the sorted
+ * set of instructions its threads would be waiting on: those that
+ * consume a character, and Match or MatchEnd.  The sets are stored
+ * end to end in sets[], and found again through a hash table of
+ * state numbers.  State 0 is always the empty set (the dead state).
+ */
+struct Builder {
+  struct Program *prog;
+  int *sets;     /* state i is sets[first[i]] to sets[first[i+1]-1] */
+  int *first;    /* maxstates+1 offsets into sets */
+  int *table;    /* hash table of state numbers, -1 when empty */
+  int *trans;    /* maxstates * nclasses transitions */
+  unsigned char *accept;  /* DFAFlags for each state */
+  int *mark, *stack, *seeds, *set;  /* scratch, one per instruction */
+  int nstates, maxstates, nsets, maxsets, tablesize, markid;
+  int nclasses;
+  unsigned char rep[UCHAR_MAX+1];  /* a byte from each class */
+  size_t limit;
+};
+
+enum { TOOBIG=1 };  /* the construction exceeded its limit */
+
+/* Does the instruction at pc accept the byte c? */
+static int
+consumes(struct Inst *pc, int c)
+{
+  switch(pc->opcode) {
+  case CharAlt: if((char)c == pc->args.chr.alt) return 1; /* no break */
+  case Char:    return (char)c == pc->args.chr.c;
+  case CharSet: return !!(pc->args.set.charset[c] & pc->args.set.mask);
+  case ByteRange: return c >= pc->args.chr.c && c <= pc->args.chr.alt;
+  case AnyChar: return 1;
+  default:      return 0;
+  }
+}
+
+/* Partition the bytes into classes that every instruction treats
+ * alike: start with one class and split it by each instruction.
+ */
+static void
+byteclasses(struct Builder *b, struct DFA *d)
+{
+  short map[UCHAR_MAX+1][2];
+  struct Inst *pc;
+  int c, k, n, i;
+
+  memset(d->classes, 0, sizeof d->classes);
+  n = 1;
+  for(i = 0; i < b->prog->size; i++) {
+    pc = &b->prog->code[i];
+    if(pc->opcode != Char && pc->opcode != CharAlt &&
+       pc->opcode != CharSet && pc->opcode != ByteRange)
+      continue;
+    memset(map, -1, sizeof map);
+    for(k = c = 0; c <= UCHAR_MAX; c++) {
+      short *p = &map[d->classes[c]][consumes(pc, c)];
+      if(*p < 0) *p = k++;
+      d->classes[c] = *p;
+    }
+    n = k;
+  }
+  for(c = UCHAR_MAX; c >= 0; c--)
+    b->rep[d->classes[c]] = c;
+  b->nclasses = d->nclasses = n;
+}
+
+static size_t
+footprint(struct Builder *b, int maxstates, int maxsets, int tablesize)
+{
+  return (size_t)maxstates * (b->nclasses * sizeof(int) + sizeof(int) + 1)
+    + (size_t)maxsets * sizeof(int) + (size_t)tablesize * sizeof(int);
+}
+
+static unsigned
+hash(int *set, int n)
+{
+  unsigned h = 2166136261u;
+  while(n-- > 0)
+    h = (h ^ (unsigned)*set++) * 16777619u;
+  return h;
+}
+
+static int
+rehash(struct Builder *b, int tablesize)
+{
+  int *table, i, s;
+  unsigned h;
+
+  table = malloc(tablesize * sizeof *table);
+  if(table == NULL) return (errno=ENOMEM, -1);
+  memset(table, -1, tablesize * sizeof *table);
+  for(s = 0; s < b->nstates; s++) {
+    h = hash(b->sets + b->first[s], b->first[s+1] - b->first[s]);
+    for(i = h & (tablesize-1); table[i] >= 0; i = (i+1) & (tablesize-1))
+      ;
+    table[i] = s;
+  }
+  free(b->table);
+  b->table = table;
+  b->tablesize = tablesize;
+  return 0;
+}
+
+/* Make room for one more state with a set of n instructions. */
+static int
+reserve(struct Builder *b, int n)
+{
+  int maxstates = b->maxstates, maxsets = b->maxsets;
+  void *p;
+
+  while(b->nstates + 1 > maxstates) maxstates = maxstates ? 2*maxstates : 16;
+  while(b->nsets + n >= maxsets)    maxsets   = maxsets   ? 2*maxsets   : 64;
+  if(maxstates == b->maxstates && maxsets == b->maxsets)
+    return 0;
+  if(footprint(b, maxstates, maxsets, 2*maxstates) > b->limit)
+    return TOOBIG;
+  if(maxsets != b->maxsets) {
+    if((p = realloc(b->sets, maxsets * sizeof *b->sets)) == NULL) goto nomem;
+    b->sets = p;
+    b->maxsets = maxsets;
+  }
+  if(maxstates != b->maxstates) {
+    if((p = realloc(b->first, (maxstates+1) * sizeof *b->first)) == NULL)
+      goto nomem;
+    b->first = p;
+    p = realloc(b->trans, maxstates * b->nclasses * sizeof *b->trans);
+    if(p == NULL) goto nomem;
+    b->trans = p;
+    if((p = realloc(b->accept, maxstates)) == NULL) goto nomem;
+    b->accept = p;
+    b->maxstates = maxstates;
+    return rehash(b, 2*maxstates);
+  }
+  return 0;
+ nomem:
+  return (errno=ENOMEM, -1);
+}
+
+static int
+compare(const void *a, const void *b)
+{
+  return *(const int*)a - *(const int*)b;
+}
+
+/* Follow Jump, Split and Save from each of the n seeds, and find (or
+ * add) the state for the instructions so reached.  Returns the state
+ * number, TOOBIG as a negative number, or -1 on error.
+ */
+static int
+closure(struct Builder *b, int *seeds, int n)
+{
+  struct Inst *pc, *code = b->prog->code;
+  int i, s, sp = 0, size = 0, flags = 0, rc;
+  unsigned h;
+
+  if(!++b->markid) {
+    memset(b->mark, 0, b->prog->size * sizeof *b->mark);
+    b->markid = 1;
+  }
+  for(i = 0; i < n; i++) {
+    if(b->mark[seeds[i]] == b->markid) continue;
+    b->mark[seeds[i]] = b->markid;
+    b->stack[sp++] = seeds[i];
+  }
+  while(sp > 0) {
+    i = b->stack[--sp];
+    pc = &code[i];
+    switch(pc->opcode) {
+    case Jump:  s = pc->args.next.x - code; break;
+    case Save:  s = i + 1; break;
+    case Split:
+      s = pc->args.next.y - code;
+      if(b->mark[s] != b->markid) {
+	b->mark[s] = b->markid;
+	b->stack[sp++] = s;
+      }
+      s = pc->args.next.x - code;
+      break;
+    case Match:    flags |= DFAMatch;    b->set[size++] = i; continue;
+    case MatchEnd: flags |= DFAMatchEnd; b->set[size++] = i; continue;
+    default:       b->set[size++] = i;   continue;
+    }
+    if(b->mark[s] != b->markid) {
+      b->mark[s] = b->markid;
+      b->stack[sp++] = s;
+    }
+  }
+  qsort(b->set, size, sizeof *b->set, compare);
+
+  h = hash(b->set, size);
+  if(b->tablesize) {
+    for(i = h & (b->tablesize-1); (s = b->table[i]) >= 0;
+	i = (i+1) & (b->tablesize-1)) {
+      if(b->first[s+1] - b->first[s] == size &&
+	 !memcmp(b->sets + b->first[s], b->set, size * sizeof *b->set))
+	return s;
+    }
+  }
+  if((rc = reserve(b, size)) != 0)
+    return rc < 0 ? rc : -TOOBIG-1;
+  s = b->nstates++;
+  memcpy(b->sets + b->nsets, b->set, size * sizeof *b->set);
+  b->first[s] = b->nsets;
+  b->first[s+1] = b->nsets += size;
+  b->accept[s] = flags;
+  i = h & (b->tablesize-1);
+  while(b->table[i] >= 0)
+    i = (i+1) & (b->tablesize-1);
+  b->table[i] = s;
+  return s;
+}
+
+/* The subset construction proper: visit each state as it is added,
+ * finding its successor under each byte class.  Once a state accepts
+ * (contains a Match), dfaexec() stops, so it need not go anywhere.
+ */
+static int
+subsets(struct Builder *b, struct DFA *d)
+{
+  int s, c, i, n, t, k = b->nclasses;
+
+  if((t = closure(b, NULL, 0)) < 0) return t;  /* the dead state */
+  assert(t == 0);
+  n = 0;
+  if((d->start = closure(b, &n, 1)) < 0) return d->start;
+  for(s = 0; s < b->nstates; s++) {
+    for(c = 0; c < k; c++) {
+      if(b->accept[s] & DFAMatch) {
+	b->trans[s*k + c] = s;
+	continue;
+      }
+      for(n = 0, i = b->first[s]; i < b->first[s+1]; i++) {
+	if(consumes(&b->prog->code[b->sets[i]], b->rep[c]))
+	  b->seeds[n++] = b->sets[i] + 1;
+      }
+      if((t = closure(b, b->seeds, n)) < 0) return t;
+      b->trans[s*k + c] = t;
+    }
+  }
+  d->nstates = b->nstates;
+  return 0;
+}
+
+/* Hopcroft's algorithm: starting with the states partitioned by their
+ * accept flags, split blocks by the predecessors of each splitter
+ * block until no more splits are possible.  Blocks are kept as
+ * contiguous runs of elems[], with the marked states of a block moved
+ * to its front.  If its work arrays and the new tables would take
+ * more than room bytes, TOOBIG is returned and d is left as it was.
+ */
+static int
+minimize(struct DFA *d, size_t room)
+{
+  int n = d->nstates, k = d->nclasses;
+  int *elems, *loc, *block, *bfirst, *bend, *bmarked, *inwork, *work;
+  int *pfirst, *preds, *touched, *splitter, *trans;
+  unsigned char *accept;
+  int nblocks, nwork, ntouched, nsplit, a, b, c, i, j, p, s, t, z;
+  int rc = -1;
+
+  if((10 * ((size_t)n+1) + 3 * (size_t)n*k + 1) * sizeof *elems + n > room)
+    return TOOBIG;
+  elems = malloc(10 * (n+1) * sizeof *elems);
+  pfirst = malloc((n*k + 1) * sizeof *pfirst);
+  preds = malloc(n*k * sizeof *preds);
+  if(!elems || !pfirst || !preds) {
+    errno = ENOMEM;
+    goto done;
+  }
+  loc = elems + n+1;      block = loc + n+1;
+  bfirst = block + n+1;   bend = bfirst + n+1;
+  bmarked = bend + n+1;   inwork = bmarked + n+1;
+  work = inwork + n+1;    touched = work + n+1;
+  splitter = touched + n+1;
+
+  /* the predecessors of t under c are preds[pfirst[t*k+c]...] */
+  memset(pfirst, 0, (n*k + 1) * sizeof *pfirst);
+  for(s = 0; s < n; s++)
+    for(c = 0; c < k; c++)
+      pfirst[d->trans[s*k + c]*k + c + 1]++;
+  for(i = 0; i < n*k; i++)
+    pfirst[i+1] += pfirst[i];
+  for(s = 0; s < n; s++) {
+    for(c = 0; c < k; c++) {
+      t = d->trans[s*k + c]*k + c;
+      preds[pfirst[t]++] = s;
+    }
+  }
+  for(i = n*k; i > 0; i--)
+    pfirst[i] = pfirst[i-1];
+  pfirst[0] = 0;
+
+  nblocks = nwork = 0;
+  for(i = a = 0; a <= (DFAMatch|DFAMatchEnd); a++) {
+    bfirst[nblocks] = i;
+    for(s = 0; s < n; s++) {
+      if(d->accept[s] != a) continue;
+      elems[i] = s;
+      loc[s] = i++;
+      block[s] = nblocks;
+    }
+    if(i > bfirst[nblocks]) {
+      bend[nblocks] = i;
+      bmarked[nblocks] = 0;
+      inwork[nblocks] = 1;
+      work[nwork++] = nblocks++;
+    }
+  }
+
+  while(nwork > 0) {
+    a = work[--nwork];
+    inwork[a] = 0;
+    nsplit = bend[a] - bfirst[a];
+    memcpy(splitter, elems + bfirst[a], nsplit * sizeof *splitter);
+    for(c = 0; c < k; c++) {
+      ntouched = 0;
+      for(i = 0; i < nsplit; i++) {
+	t = splitter[i]*k + c;
+	for(j = pfirst[t]; j < pfirst[t+1]; j++) {
+	  p = preds[j];
+	  b = block[p];
+	  if(loc[p] < bfirst[b] + bmarked[b])
+	    continue;  /* already marked */
+	  if(bmarked[b] == 0)
+	    touched[ntouched++] = b;
+	  z = elems[bfirst[b] + bmarked[b]];
+	  elems[loc[p]] = z;
+	  loc[z] = loc[p];
+	  elems[bfirst[b] + bmarked[b]] = p;
+	  loc[p] = bfirst[b] + bmarked[b]++;
+	}
+      }
+      while(ntouched > 0) {
+	b = touched[--ntouched];
+	if(bmarked[b] < bend[b] - bfirst[b]) {
+	  z = nblocks++;  /* the marked states become block z */
+	  bfirst[z] = bfirst[b];
+	  bend[z] = bfirst[b] += bmarked[b];
+	  bmarked[z] = inwork[z] = 0;
+	  for(i = bfirst[z]; i < bend[z]; i++)
+	    block[elems[i]] = z;
+	  if(inwork[b] || bend[z] - bfirst[z] < bend[b] - bfirst[b])
+	    s = z;
+	  else
+	    s = b;
+	  if(!inwork[s]) {
+	    inwork[s] = 1;
+	    work[nwork++] = s;
+	  }
+	}
+	bmarked[b] = 0;
+      }
+    }
+  }
+
+  /* Number the blocks so that the dead state stays 0. */
+  memset(work, -1, nblocks * sizeof *work);
+  work[block[0]] = 0;
+  for(s = 0, j = 1; s < n; s++)
+    if(work[block[s]] < 0) work[block[s]] = j++;
+  trans = malloc(nblocks * k * sizeof *trans);
+  accept = malloc(nblocks);
+  if(!trans || !accept) {
+    free(trans);
+    free(accept);
+    errno = ENOMEM;
+    goto done;
+  }
+  for(b = 0; b < nblocks; b++) {
+    s = elems[bfirst[b]];
+    accept[work[b]] = d->accept[s];
+    for(c = 0; c < k; c++)
+      trans[work[b]*k + c] = work[block[d->trans[s*k + c]]];
+  }
+  free(d->trans);
+  free(d->accept);
+  d->trans = trans;
+  d->accept = accept;
+  d->start = work[block[d->start]];
+  d->nstates = nblocks;
+  rc = 0;
+ done:
+  free(elems);
+  free(pfirst);
+  free(preds);
+  return rc;
+}
+
+int
+builddfa(struct Program *prog, size_t limit)
+{
+  struct Builder b;
+  struct DFA *d;
+  int rc = -1, e;
+
+  if(!prog || !prog->code || prog->size < 1)
+    return (errno=EINVAL, -1);
+  freedfa(prog);
+  memset(&b, 0, sizeof b);
+  b.prog  = prog;
+  b.limit = limit ? limit : DFA_MEMLIMIT;
+  b.mark  = calloc(4 * prog->size, sizeof *b.mark);
+  d = calloc(1, sizeof *d);
+  if(!b.mark || !d) {
+    errno = ENOMEM;
+    goto done;
+  }
+  b.stack = b.mark + prog->size;
+  b.seeds = b.stack + prog->size;
+  b.set   = b.seeds + prog->size;
+  byteclasses(&b, d);
+  rc = subsets(&b, d);
+  d->trans  = b.trans;   b.trans  = NULL;
+  d->accept = b.accept;  b.accept = NULL;
+  if(rc == 0)  /* with what's left of the limit */
+    rc = minimize(d, b.limit - footprint(&b, b.maxstates, b.maxsets,
+					   b.tablesize));
+  if(rc == 0) {
+    prog->dfa = d;
+    d = NULL;
+  } else if(rc != -1) {
+    rc = 0;  /* too big: fall back on the instructions */
+  }
+ done:
+  e = errno;
+  if(d) {
+    free(d->trans);
+    free(d->accept);
+    free(d);
+  }
+  free(b.mark);
+  free(b.sets);
+  free(b.first);
+  free(b.table);
+  free(b.trans);
+  free(b.accept);
+  errno = e;
+  return rc;
+}
+
+void
+freedfa(struct Program *prog)
+{
+  if(prog->dfa) {
+    free(prog->dfa->trans);
+    free(prog->dfa->accept);
+    free(prog->dfa);
+    prog->dfa = NULL;
+  }
+}
+
+int
+dfaexec(struct DFA *dfa, char *input)
+{
+  unsigned char *sp = (unsigned char*)input;
+  int s = dfa->start;
+
+  for(;; sp++) {
+    if(dfa->accept[s] & DFAMatch)
+      return 1;
+    if(!*sp)
+      return !!(dfa->accept[s] & DFAMatchEnd);
+    s = dfa->trans[s*dfa->nclasses + dfa->classes[*sp]];
+    if(s == 0)
+      return 0;
+  }
+}
+
+/* Run up to LANES inputs at once, so that the (independent) loads of
+ * their transitions can overlap.  The lanes step together through
+ * blocks of up to BLOCK bytes, without a branch per byte: the dead
+ * state leads only to itself, and a lane that passes through a
+ * matching state is marked.  Between blocks, the lanes that are done
+ * are given the next inputs; idle lanes sit in the dead state.
+ */
+enum { LANES=8, BLOCK=64 };
+
+int
+dfabatch(struct DFA *dfa, char **inputs, size_t *lens, int n, int *results)
+{
+  const unsigned char *sp[LANES], *end[LANES];
+  int s[LANES], hit[LANES], id[LANES];
+  int *trans = dfa->trans, nc = dfa->nclasses;
+  int i, k, next = 0, live = 0;
+  size_t j, m;
+
+  for(k = 0; k < LANES; k++) {
+    id[k] = -1;
+    s[k] = hit[k] = 0;
+  }
+  for(;;) {
+    for(k = 0; k < LANES; k++) {
+      if(id[k] >= 0) {  /* is this lane done? */
+	if(!hit[k] && s[k] != 0 && sp[k] < end[k])
+	  continue;
+	i = id[k];
+	results[i] = hit[k] || (s[k] != 0 && (dfa->accept[s[k]] & DFAMatchEnd));
+	id[k] = -1;
+	live--;
+      }
+      while(id[k] < 0 && next < n) {
+	i = next++;
+	sp[k]  = (const unsigned char*)inputs[i];
+	end[k] = sp[k] + (lens ? lens[i] : strlen(inputs[i]));
+	s[k]   = dfa->start;
+	hit[k] = dfa->accept[s[k]] & DFAMatch;
+	if(hit[k] || sp[k] == end[k])
+	  results[i] = hit[k] || (dfa->accept[s[k]] & DFAMatchEnd);
+	else {
+	  id[k] = i;
+	  live++;
+	}
+      }
+    }
+    if(live == 0)
+      return 0;
+    m = BLOCK;
+    for(k = 0; k < LANES; k++) {
+      if(id[k] < 0) continue;
+      if((size_t)(end[k] - sp[k]) < m) m = end[k] - sp[k];
+    }
+    for(k = 0; k < LANES; k++) {
+      if(id[k] >= 0) continue;
+      for(i = 0; id[i] < 0; i++)
+	;
+      sp[k] = sp[i];  /* any bytes will do in the dead state */
+      s[k] = 0;
+    }
+    for(j = 0; j < m; j++) {
+      for(k = 0; k < LANES; k++) {
+	s[k] = trans[s[k]*nc + dfa->classes[sp[k][j]]];
+	hit[k] |= dfa->accept[s[k]] & DFAMatch;
+      }
+    }
+    for(k = 0; k < LANES; k++)
+      sp[k] += m;
+  }
+}
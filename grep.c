@@ -21,86 +21,229 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include "core.h"
 #include "debug.h"
+#include "input.h"
+
+/* Output is gathered in one large buffer and written with writev(),
+ * which also takes any span too big to be worth copying, along with
+ * what is buffered before it.  The buffer is flushed at the end of
+ * each file, and after each line if it goes to a terminal (as stdio
+ * would), so that a pipe like "tail -f log | grep ERROR" shows each
+ * line as it comes.
+ */
+enum { OUTSIZE = 1<<16, BIGSPAN = 1<<12 };
+
+static struct Output {
+  size_t n;
+  int tty;  /* flush each line? */
+  char buf[OUTSIZE];
+} out;
 
 static int
-print(char *line, char **captures, char *file, char *fmt)
+flush(char *span, size_t len)
 {
-  size_t len;
-  int i;
-  
-  if(file && printf("%s:", file) < 0)
-    return EOF;
-  if(!fmt)
-    return puts(line);
-  for(;;) {
-    if((len = strcspn(fmt, "$")) != 0) {
-      if(fwrite(fmt, 1, len, stdout) < len)
-	return EOF;
-      fmt += len;
+  struct iovec iov[2], *v = iov;
+  int n = 2;
+  ssize_t w;
+
+  iov[0].iov_base = out.buf;
+  iov[0].iov_len  = out.n;
+  iov[1].iov_base = span;
+  iov[1].iov_len  = len;
+  out.n = 0;
+  while(n > 0) {
+    if(v->iov_len == 0) {
+      v++, n--;
+      continue;
     }
-    if(!fmt[0])
-      break;
-    if(isdigit(fmt[1])) {
-      i = (fmt[1] - '0') * 2;
-      fmt += 2;
-      if(captures[i] && captures[i+1]) {
-	len = captures[i+1] - captures[i];
-	if(fwrite(captures[i], 1, len, stdout) < len)
-	  return EOF;
-      }
-    } else {
-      switch(fmt[1]) {
-        case '$':  fmt++;  /* no break */
-        case '\0': len = 1; break;
-        default:   len = 2;
-      }
-      if(fwrite(fmt, 1, len, stdout) < len)
-	return EOF;
-      fmt += len;
+    if((w = writev(STDOUT_FILENO, v, n)) < 0) {
+      if(errno == EINTR) continue;
+      return EOF;
+    }
+    for(; n > 0 && (size_t)w >= v->iov_len; v++, n--)
+      w -= v->iov_len;
+    if(n > 0) {
+      v->iov_base = (char*)v->iov_base + w;
+      v->iov_len -= w;
     }
   }
-  return putchar('\n');
+  return 0;
+}
+
+static int
+output(char *s, size_t len)
+{
+  if(len >= BIGSPAN)
+    return flush(s, len);
+  if(len > OUTSIZE - out.n && flush(NULL, 0) == EOF)
+    return EOF;
+  memcpy(out.buf + out.n, s, len);
+  out.n += len;
+  return 0;
+}
+
+static int
+outputc(int c)
+{
+  if(out.n == OUTSIZE && flush(NULL, 0) == EOF)
+    return EOF;
+  out.buf[out.n++] = c;
+  return 0;
+}
+
+/* End a line of output. */
+static int
+endline(void)
+{
+  if(outputc('\n') == EOF)
+    return EOF;
+  return out.tty ? flush(NULL, 0) : 0;
+}
+
+static int
+outputnum(unsigned long n)
+{
+  char buf[3 * sizeof n], *s = buf + sizeof buf;
+
+  do *--s = '0' + n % 10; while(n /= 10);
+  return output(s, buf + sizeof buf - s);
+}
+
+static int
+emit(void *arg, char *s, size_t len)
+{
+  (void)arg;
+  return output(s, len);
 }
 
+/* Print "file:" and "lineno:" as needed before a line or match. */
 static int
-readline(char *buf, size_t len, FILE* fin)
+prefix(char *file, unsigned long lineno)
 {
-  if(fgets(buf, len, fin) == NULL)
-    return feof(fin) ? 0 : -1;
-  len = strlen(buf);
-  if(buf[len-1] == '\n')
-    buf[--len] = '\0';
-  return 1;
+  if(file && (output(file, strlen(file)) < 0 || outputc(':') < 0))
+    return EOF;
+  if(lineno && (outputnum(lineno) < 0 || outputc(':') < 0))
+    return EOF;
+  return 0;
+}
+
+static int
+print(char *line, size_t len, char **captures, char *file,
+      unsigned long lineno, struct Piece *fmt)
+{
+  if(prefix(file, lineno) < 0)
+    return EOF;
+  if(!fmt)
+    return output(line, len) < 0 ? EOF : endline();
+  if(expand(fmt, captures, emit, NULL) < 0)
+    return EOF;
+  return endline();
+}
+
+/* With -r, a line's prefix is printed along with the first span that
+ * substitute() emits, which it does only once a match is found.
+ */
+struct Replacing {
+  char *file;
+  unsigned long lineno;
+  int started;
+};
+
+static int
+emitreplaced(void *arg, char *s, size_t len)
+{
+  struct Replacing *r = arg;
+
+  if(!r->started) {
+    r->started = 1;
+    if(prefix(r->file, r->lineno) < 0)
+      return EOF;
+  }
+  return output(s, len);
 }
 
+enum Mode {
+  Lines,    /* print each matching line */
+  Matches,  /* print every match in each line (-g) */
+  Names,    /* print the names of files with a match (-l) */
+  Quiet,    /* print nothing; just find a match (-q) */
+  Count,    /* print how many lines match (-c) */
+  Replace   /* print matching lines with every match replaced (-r) */
+};
+
 static int
-grep(struct Program *prog, char *infile, char *outfmt)
+grep(struct Matcher *m, char *infile, struct Piece *fmt, enum Mode mode,
+     int number)
 {
-  char buf[BUFSIZ], *captures[20];
+  char *line, *name;
+  unsigned long lineno = 0, count = 0;
+  size_t len;
   int rc, matched = 0;
-  FILE *fin = stdin;
+  struct Input *in;
 
-  if(infile && !strcmp(infile, "-"))
+  if(infile && !strcmp(infile, "-")) {
     infile = "(standard input)";
-  else if(infile && (fin = fopen(infile, "r")) == NULL) {
-    perror(infile);
+    in = openinput(NULL);
+  } else {
+    in = openinput(infile);
+  }
+  name = infile ? infile : "(standard input)";
+  if(in == NULL) {
+    perror(name);
     return -1;
   }
-  while((rc = readline(buf, sizeof buf, fin)) > 0) {
-    if((rc = vm(prog, buf, captures)) > 0) {
+  while((rc = readline(in, &line, &len)) > 0) {
+    lineno++;
+    if(len < (size_t)m->prog->minlen)
+      continue;  /* too short to match */
+    if(mode == Replace) {
+      struct Replacing r = { infile, number ? lineno : 0, 0 };
+      if((rc = substitute(m, line, fmt, 1, emitreplaced, &r)) > 0) {
+	matched = 1;
+	rc = endline();
+      }
+      if(rc < 0) break;
+      continue;
+    }
+    if(!fmt) {  /* the line is printed whole, if at all */
+      rc = anymatch(m, line);
+    } else {
+      setinput(m, line);
+      rc = nextmatch(m);
+    }
+    if(rc > 0) {
       matched = 1;
-      rc = print(buf, captures, infile, outfmt);
+      count++;
+      if(mode == Names || mode == Quiet)
+	break;  /* one match is enough */
+      if(mode == Count)
+	continue;
+      rc = print(line, len, m->saved, infile, number ? lineno : 0, fmt);
+      while(mode == Matches && rc >= 0 && (rc = nextmatch(m)) > 0)
+	rc = print(line, len, m->saved, infile, number ? lineno : 0, fmt);
     }
     if(rc < 0) break;
   }
+  if(rc >= 0 && matched && mode == Names)
+    rc = output(name, strlen(name)) < 0 ? EOF : endline();
+  if(rc >= 0 && mode == Count) {
+    if(infile && (output(infile, strlen(infile)) < 0 || outputc(':') < 0))
+      rc = EOF;
+    else
+      rc = outputnum(count) < 0 ? EOF : endline();
+  }
+  if(flush(NULL, 0) == EOF) {  /* before any message below */
+    perror("write");
+    matched = -1;
+  }
   if(rc < 0) {
-    perror(infile ? infile : "(standard input)");
+    perror(name);
     matched = -1;
   }
-  if(fin && fin != stdin && fclose(fin) == EOF) {
-    perror(infile);
+  if(closeinput(in) < 0) {
+    perror(name);
     return -1;
   }
   return matched;
@@ -110,32 +253,82 @@ int
 main(int argc, char *argv[])
 {
   struct Program prog;
+  struct Matcher m;
+  struct Stats stats;
+  enum Mode mode = Lines;
+  struct Piece *fmt = NULL;
   char *outfmt = NULL;
-  int debug = 0, matched = 0, errors = 0;
+  int debug = 0, matched = 0, errors = 0, profile = 0, number = 0;
   int i, opt, rc, flags = 0;
 
-  while((opt = getopt(argc, argv, "ido:")) != -1) {
+  while((opt = getopt(argc, argv, "iuDdSk:glqcnr:o:")) != -1) {
     switch(opt) {
       case 'i': flags |= IgnoreCase; break;
+      case 'u': flags |= UTF8;       break;
+      case 'D': flags |= BuildDFA;   break;
       case 'd': debug  = 1;      break;
+      case 'S': profile = 1;     break;
       case 'o': outfmt = optarg; break;
+      case 'g': mode = Matches; break;
+      case 'l': mode = Names; flags |= Earliest; break;
+      case 'q': mode = Quiet; flags |= Earliest; break;
+      case 'c': mode = Count; flags |= Earliest; break;
+      case 'n': number = 1; break;
+      case 'r': mode = Replace; outfmt = optarg; break;
+      case 'k':
+	switch(optarg[0]) {
+	  case 'e': flags |= Earliest;      break;
+	  case 'f': flags |= LeftmostFirst; break;
+	  case 'l': break;  /* leftmost-longest is the default */
+	  default: goto badargs;
+	}
+	break;
       default: goto badargs;
     }
   }
   if((i = optind) >= argc) {
   badargs:
-    fprintf(stderr, "usage: %s [-id] [-o fmt] (regex) [files...]\n",
-	    argv[0]);
+    fprintf(stderr, "usage: %s [-iuDdSglqcn] [-k kind] [-o fmt | -r repl] "
+	    "(regex) [files...]\n", argv[0]);
     return 2;
   }
   rc = compile(&prog, argv[i++], flags);
   if(rc) { perror("compile"); return 2; }
-  if(debug) printprogram(stderr, &prog);
+  if(debug) {
+    printprogram(stderr, &prog);
+    if(prog.dfa) printdfa(stderr, &prog);
+  }
+  if(profile && initstats(&stats, &prog)) {
+    perror("stats");
+    profile = 0;
+  }
+  if(mode == Matches && !outfmt)
+    outfmt = "$0";
+  if((outfmt && (fmt = parsetemplate(outfmt)) == NULL) ||
+     initmatcher(&m, &prog)) {
+    perror("grep");
+    return 2;
+  }
+  out.tty = isatty(STDOUT_FILENO);
+  if(argc - i > 1)
+    prefetch(&argv[i], argc - i);  /* if it fails, files are read as usual */
   do {
-    rc = grep(&prog, argv[i], outfmt);
+    rc = grep(&m, argv[i], fmt, mode, number);
     if     (rc > 0) matched = 1;
     else if(rc < 0) errors  = 1;
-  } while(++i < argc);
+  } while(++i < argc && !(matched && mode == Quiet));
+  if(profile) {
+    printstats(stderr, &stats);
+    if(debug) printprogram(stderr, &prog);
+    freestats(&stats);
+  }
+  endprefetch();
+  if(flush(NULL, 0) == EOF) {
+    perror("write");
+    errors = 1;
+  }
+  free(fmt);
+  freematcher(&m);
   freeprogram(&prog);
   return errors ? 2 : !matched;
 }
@@ -0,0 +1,645 @@
+/* A Regular Expression Library - Example Grep Input
+ * Copyright (c) 2012 Eric Mulvaney
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "input.h"
+
+enum { BLOCKSIZE = 1<<16, NSLOTS = 8 };
+
+/* Compressed input is inflated by its own thread into a ring of
+ * NSLOTS blocks.  Only that thread fills blocks (at head) and only the
+ * reading thread empties them (at tail), so the ring needs no lock:
+ * two semaphores count the full and empty slots, and put the thread
+ * that runs ahead to sleep.  A block of length 0 ends the input; one
+ * of length -1 carries an error.
+ */
+struct Block {
+  char *data;
+  ssize_t len;
+  int err;  /* errno, when len is -1 */
+};
+
+struct Input {
+  int fd;
+  char *p, *end;  /* the bytes not yet read */
+  int eof;
+  char *buf;      /* what was read from fd */
+  size_t nbuf;
+  int slot;       /* buf's index in ring.bufs, or -1 if it's our own */
+  int gzip;
+  z_stream z;
+  int zrc;        /* inflate()'s last result */
+  pthread_t thread;
+  struct Block slots[NSLOTS];
+  sem_t full, empty;
+  int head, tail;
+  struct Block *block;  /* the block being read, or NULL */
+  atomic_int stop;      /* set to end the thread early */
+  char *line;           /* see readline() */
+  size_t linemax;
+};
+
+static ssize_t
+readsome(int fd, char *buf, size_t len)
+{
+  ssize_t n;
+
+  while((n = read(fd, buf, len)) < 0 && errno == EINTR)
+    ;
+  return n;
+}
+
+static void
+waitfor(sem_t *sem)
+{
+  while(sem_wait(sem) < 0 && errno == EINTR)
+    ;
+}
+
+/* Inflate the next block's worth of input, or less at the end. */
+static void
+inflateblock(struct Input *in, struct Block *b, int *done)
+{
+  ssize_t n;
+
+  in->z.next_out  = (unsigned char*)b->data;
+  in->z.avail_out = BLOCKSIZE;
+  b->err = 0;
+  while(in->z.avail_out > 0) {
+    if(in->z.avail_in == 0) {
+      if((n = readsome(in->fd, in->buf, BLOCKSIZE)) < 0) {
+	b->err = errno;
+	break;
+      }
+      if(n == 0) {  /* the end, unless a member was cut short */
+	if(in->zrc != Z_STREAM_END) b->err = EBADMSG;
+	*done = 1;
+	break;
+      }
+      in->z.next_in  = (unsigned char*)in->buf;
+      in->z.avail_in = n;
+    }
+    if(in->zrc == Z_STREAM_END)
+      inflateReset(&in->z);  /* another member follows */
+    in->zrc = inflate(&in->z, Z_NO_FLUSH);
+    if(in->zrc != Z_OK && in->zrc != Z_STREAM_END) {
+      b->err = in->zrc == Z_MEM_ERROR ? ENOMEM : EBADMSG;
+      break;
+    }
+  }
+  b->len = b->err ? -1 : BLOCKSIZE - (ssize_t)in->z.avail_out;
+}
+
+static void*
+inflater(void *arg)
+{
+  struct Input *in = arg;
+  struct Block *b;
+  int done = 0;
+
+  for(;;) {
+    waitfor(&in->empty);
+    if(atomic_load(&in->stop))
+      break;
+    b = &in->slots[in->head];
+    in->head = (in->head + 1) % NSLOTS;
+    if(done)
+      b->len = 0;
+    else
+      inflateblock(in, b, &done);
+    sem_post(&in->full);
+    if(b->len <= 0)
+      break;
+  }
+  return NULL;
+}
+
+static int
+startgzip(struct Input *in)
+{
+  int i;
+
+  memset(&in->z, 0, sizeof in->z);
+  if(inflateInit2(&in->z, 15 + 16) != Z_OK)  /* gzip only */
+    return (errno=ENOMEM, -1);
+  in->z.next_in  = (unsigned char*)in->buf;
+  in->z.avail_in = in->nbuf;
+  in->slots[0].data = malloc(NSLOTS * BLOCKSIZE);
+  if(in->slots[0].data == NULL) {
+    inflateEnd(&in->z);
+    return (errno=ENOMEM, -1);
+  }
+  for(i = 1; i < NSLOTS; i++)
+    in->slots[i].data = in->slots[0].data + i * BLOCKSIZE;
+  sem_init(&in->full, 0, 0);
+  sem_init(&in->empty, 0, NSLOTS);
+  atomic_init(&in->stop, 0);
+  if((errno = pthread_create(&in->thread, NULL, inflater, in)) != 0) {
+    sem_destroy(&in->full);
+    sem_destroy(&in->empty);
+    free(in->slots[0].data);
+    inflateEnd(&in->z);
+    return -1;
+  }
+  in->gzip = 1;
+  return 0;
+}
+
+/* Files named up front (see prefetch()) are opened and have their
+ * first block read through io_uring, several at a time, into a fixed
+ * set of registered buffers.  Each file holds its buffer until it is
+ * closed, and is then closed by the ring too; meanwhile the next files
+ * are opened and read, so a search through many small files makes a
+ * few io_uring_enter() calls rather than open(), read() and close()
+ * for each.  A regular file whose first read comes up short is taken
+ * to end there; anything else (a pipe, a terminal, a file in /proc)
+ * is read until read() returns 0.
+ */
+enum { NBUFS = 16, NENTRIES = 64 };
+
+enum { OpOpen, OpRead, OpClose };  /* in the low bits of user_data */
+
+enum AheadState { Waiting, Opening, Reading, Ready, Failed, Skipped };
+
+struct Ahead {
+  char *path;
+  enum AheadState state;
+  int fd, slot, err;
+  size_t len;
+};
+
+static struct Ring {
+  int fd;  /* -1 if not in use */
+  unsigned *sqhead, *sqtail, *sqarray, sqmask, sqentries;
+  unsigned *cqhead, *cqtail, cqmask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sqmap, *cqmap;
+  size_t sqsize, cqsize, sqesize;
+  unsigned queued;    /* entries not yet submitted */
+  unsigned inflight;  /* entries submitted but not completed */
+  char *bufs;         /* NBUFS * BLOCKSIZE, registered */
+  int free[NBUFS], nfree;
+  struct Ahead *files;
+  int nfiles;
+  int next;  /* the next file to open */
+  int cur;   /* the next file openinput() may ask for */
+} ring = { -1 };
+
+static struct io_uring_sqe*
+getsqe(void)
+{
+  struct io_uring_sqe *sqe;
+  unsigned tail = *ring.sqtail + ring.queued, i;
+
+  if(tail - __atomic_load_n(ring.sqhead, __ATOMIC_ACQUIRE) >= ring.sqentries)
+    return NULL;
+  i = tail & ring.sqmask;
+  sqe = &ring.sqes[i];
+  memset(sqe, 0, sizeof *sqe);
+  ring.sqarray[i] = i;
+  ring.queued++;
+  return sqe;
+}
+
+static void
+complete(struct io_uring_cqe *cqe)
+{
+  struct Ahead *f = &ring.files[cqe->user_data >> 2];
+  struct io_uring_sqe *sqe;
+  int err = -cqe->res;
+
+  switch(cqe->user_data & 3) {
+  case OpOpen:
+    if(cqe->res < 0)
+      break;
+    f->fd = cqe->res;
+    if((sqe = getsqe()) == NULL) {
+      err = EBUSY;
+      break;
+    }
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = f->fd;
+    sqe->addr = (unsigned long)(ring.bufs + f->slot * BLOCKSIZE);
+    sqe->len = BLOCKSIZE;
+    sqe->off = (unsigned long long)-1;  /* the file's own position */
+    sqe->buf_index = f->slot;
+    sqe->user_data = cqe->user_data - OpOpen + OpRead;
+    f->state = Reading;
+    return;
+  case OpRead:
+    if(cqe->res < 0)
+      break;
+    f->len = cqe->res;
+    f->state = Ready;
+    return;
+  default:  /* OpClose */
+    return;
+  }
+  f->err = err;
+  f->state = Failed;
+}
+
+/* Submit what's queued and handle what has completed, first waiting
+ * for at least one completion if wait is set.
+ */
+static int
+submit(int wait)
+{
+  unsigned head, tail, n = ring.queued;
+  int rc;
+
+  __atomic_store_n(ring.sqtail, *ring.sqtail + n, __ATOMIC_RELEASE);
+  ring.queued = 0;
+  if(n > 0 || wait) {
+    while((rc = syscall(__NR_io_uring_enter, ring.fd, n, wait ? 1 : 0,
+			wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) < 0)
+      if(errno != EINTR)
+	return -1;
+  }
+  ring.inflight += n;
+  head = *ring.cqhead;
+  tail = __atomic_load_n(ring.cqtail, __ATOMIC_ACQUIRE);
+  for(; head != tail; head++, ring.inflight--)
+    complete(&ring.cqes[head & ring.cqmask]);
+  __atomic_store_n(ring.cqhead, head, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Start opening files while there are buffers to read them into. */
+static void
+startmore(void)
+{
+  struct io_uring_sqe *sqe;
+  struct Ahead *f;
+
+  while(ring.nfree > 0 && ring.next < ring.nfiles) {
+    f = &ring.files[ring.next];
+    if(!strcmp(f->path, "-")) {
+      f->state = Skipped;
+      ring.next++;
+      continue;
+    }
+    if((sqe = getsqe()) == NULL)
+      break;
+    f->slot = ring.free[--ring.nfree];
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)f->path;
+    sqe->open_flags = O_RDONLY;
+    sqe->user_data = (unsigned long long)ring.next++ << 2 | OpOpen;
+    f->state = Opening;
+  }
+}
+
+/* Give back a file's buffer and have the ring close it. */
+static void
+release(int slot, int fd)
+{
+  struct io_uring_sqe *sqe;
+
+  if(slot >= 0)
+    ring.free[ring.nfree++] = slot;
+  if(fd >= 0) {
+    if((sqe = getsqe()) != NULL) {
+      sqe->opcode = IORING_OP_CLOSE;
+      sqe->fd = fd;
+      sqe->user_data = OpClose;
+    } else {
+      close(fd);
+    }
+  }
+  startmore();
+}
+
+/* Wait for the file to be read (or to fail). */
+static void
+settle(struct Ahead *f)
+{
+  while(f->state == Opening || f->state == Reading) {
+    if(submit(1) < 0) {
+      f->err = errno;
+      f->state = Failed;
+    }
+  }
+}
+
+int
+prefetch(char **paths, int n)
+{
+  struct io_uring_params p;
+  struct iovec iov[NBUFS];
+  char *map;
+  int i;
+
+  if(ring.fd >= 0 || n < 1)
+    return (errno=EINVAL, -1);
+  memset(&p, 0, sizeof p);
+  if((ring.fd = syscall(__NR_io_uring_setup, NENTRIES, &p)) < 0)
+    return -1;
+  if(!(p.features & IORING_FEAT_RW_CUR_POS)) {  /* too old */
+    errno = ENOSYS;
+    goto fail;
+  }
+  ring.sqsize  = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring.cqsize  = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring.sqesize = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring.sqmap = mmap(NULL, ring.sqsize, PROT_READ|PROT_WRITE,
+		    MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+  ring.cqmap = mmap(NULL, ring.cqsize, PROT_READ|PROT_WRITE,
+		    MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+  ring.sqes  = mmap(NULL, ring.sqesize, PROT_READ|PROT_WRITE,
+		    MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+  if(ring.sqmap == MAP_FAILED || ring.cqmap == MAP_FAILED ||
+     ring.sqes == MAP_FAILED)
+    goto fail;
+  map = ring.sqmap;
+  ring.sqhead    = (unsigned*)(map + p.sq_off.head);
+  ring.sqtail    = (unsigned*)(map + p.sq_off.tail);
+  ring.sqmask    = *(unsigned*)(map + p.sq_off.ring_mask);
+  ring.sqarray   = (unsigned*)(map + p.sq_off.array);
+  ring.sqentries = p.sq_entries;
+  map = ring.cqmap;
+  ring.cqhead = (unsigned*)(map + p.cq_off.head);
+  ring.cqtail = (unsigned*)(map + p.cq_off.tail);
+  ring.cqmask = *(unsigned*)(map + p.cq_off.ring_mask);
+  ring.cqes   = (struct io_uring_cqe*)(map + p.cq_off.cqes);
+  ring.bufs = malloc(NBUFS * BLOCKSIZE);
+  ring.files = calloc(n, sizeof *ring.files);
+  if(!ring.bufs || !ring.files) {
+    errno = ENOMEM;
+    goto fail;
+  }
+  for(i = 0; i < NBUFS; i++) {
+    iov[i].iov_base = ring.bufs + i * BLOCKSIZE;
+    iov[i].iov_len  = BLOCKSIZE;
+    ring.free[i] = NBUFS - 1 - i;
+  }
+  ring.nfree = NBUFS;
+  if(syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS,
+	     iov, NBUFS) < 0)
+    goto fail;
+  for(i = 0; i < n; i++) {
+    ring.files[i].path = paths[i];
+    ring.files[i].fd = ring.files[i].slot = -1;
+  }
+  ring.nfiles = n;
+  startmore();
+  if(submit(0) == 0)
+    return 0;
+ fail:
+  endprefetch();
+  return -1;
+}
+
+void
+endprefetch(void)
+{
+  int e = errno, i;
+
+  if(ring.fd < 0)
+    return;
+  if(ring.files) {  /* wait for what's in flight, then close it all */
+    for(i = ring.cur; i < ring.next; i++) {
+      settle(&ring.files[i]);
+      if(ring.files[i].fd >= 0) close(ring.files[i].fd);
+    }
+    ring.next = ring.nfiles;  /* start nothing more */
+    while(ring.inflight + ring.queued > 0 && submit(1) == 0)
+      ;
+  }
+  if(ring.sqmap && ring.sqmap != MAP_FAILED) munmap(ring.sqmap, ring.sqsize);
+  if(ring.cqmap && ring.cqmap != MAP_FAILED) munmap(ring.cqmap, ring.cqsize);
+  if(ring.sqes && ring.sqes != MAP_FAILED) munmap(ring.sqes, ring.sqesize);
+  close(ring.fd);
+  free(ring.bufs);
+  free(ring.files);
+  memset(&ring, 0, sizeof ring);
+  ring.fd = -1;
+  errno = e;
+}
+
+/* Take a prefetched file's first block, if path was prefetched. */
+static int
+fromring(struct Input *in, char *path)
+{
+  struct Ahead *f;
+  struct stat st;
+  int i;
+
+  for(i = ring.cur; i < ring.nfiles && ring.files[i].path != path; i++)
+    ;
+  if(i == ring.nfiles)
+    return 0;  /* not one of ours: read it as usual */
+  for(; ring.cur < i; ring.cur++) {  /* skipped by the caller */
+    f = &ring.files[ring.cur];
+    settle(f);
+    release(f->slot, f->fd);
+  }
+  f = &ring.files[ring.cur++];
+  if(f->state == Waiting) {
+    startmore();  /* it must be next */
+    submit(0);
+  }
+  settle(f);
+  if(f->state == Failed) {
+    release(f->slot, f->fd);
+    submit(0);
+    return (errno=f->err, -1);
+  }
+  in->fd   = f->fd;
+  in->slot = f->slot;
+  in->buf  = ring.bufs + f->slot * BLOCKSIZE;
+  in->nbuf = f->len;
+  in->eof  = f->len == 0 || (f->len < BLOCKSIZE &&
+			     fstat(f->fd, &st) == 0 && S_ISREG(st.st_mode));
+  return 1;
+}
+
+struct Input*
+openinput(char *path)
+{
+  struct Input *in;
+  ssize_t n;
+  int rc = 0;
+
+  if((in = calloc(1, sizeof *in)) == NULL)
+    return (errno=ENOMEM, NULL);
+  in->slot = -1;
+  if(path && ring.fd >= 0 && (rc = fromring(in, path)) < 0) {
+    free(in);
+    return NULL;
+  }
+  if(rc == 0) {
+    in->fd = path ? open(path, O_RDONLY) : STDIN_FILENO;
+    if(in->fd < 0 || (in->buf = malloc(BLOCKSIZE)) == NULL)
+      goto fail;
+  }
+  while(!in->eof && in->nbuf < 2) {  /* enough to see the magic bytes */
+    n = readsome(in->fd, in->buf + in->nbuf, BLOCKSIZE - in->nbuf);
+    if(n < 0) goto fail;
+    in->nbuf += n;
+    in->eof = n == 0;
+  }
+  if(in->nbuf >= 2 && (unsigned char)in->buf[0] == 0x1f &&
+     (unsigned char)in->buf[1] == 0x8b) {
+    in->eof = 0;
+    if(startgzip(in) < 0)
+      goto fail;
+  } else {
+    in->p   = in->buf;
+    in->end = in->buf + in->nbuf;
+  }
+  return in;
+ fail:
+  n = errno;
+  if(in->slot >= 0) {
+    release(in->slot, in->fd);
+    submit(0);
+  } else {
+    if(path && in->fd >= 0) close(in->fd);
+    free(in->buf);
+  }
+  free(in);
+  errno = n;
+  return NULL;
+}
+
+/* Make more bytes available: 1 if there are, 0 at the end, -1 on
+ * error.
+ */
+static int
+refill(struct Input *in)
+{
+  ssize_t n;
+
+  if(in->eof)
+    return 0;
+  if(!in->gzip) {
+    if((n = readsome(in->fd, in->buf, BLOCKSIZE)) < 0)
+      return -1;
+    in->p   = in->buf;
+    in->end = in->buf + n;
+    in->eof = n == 0;
+    return n > 0;
+  }
+  if(in->block) {  /* hand it back */
+    in->block = NULL;
+    sem_post(&in->empty);
+  }
+  waitfor(&in->full);
+  in->block = &in->slots[in->tail];
+  in->tail = (in->tail + 1) % NSLOTS;
+  if(in->block->len < 0) {
+    in->eof = 1;
+    return (errno=in->block->err, -1);
+  }
+  in->p   = in->block->data;
+  in->end = in->block->data + in->block->len;
+  in->eof = in->block->len == 0;
+  return !in->eof;
+}
+
+/* Make room for len bytes of line. */
+static int
+growline(struct Input *in, size_t len)
+{
+  size_t max = in->linemax ? in->linemax : 256;
+  char *p;
+
+  while(max < len)
+    max *= 2;
+  if(max == in->linemax)
+    return 0;
+  if((p = realloc(in->line, max)) == NULL)
+    return (errno=ENOMEM, -1);
+  in->line = p;
+  in->linemax = max;
+  return 0;
+}
+
+int
+readline(struct Input *in, char **line, size_t *n)
+{
+  size_t i = 0, take;
+  char *nl = NULL;
+  int rc;
+
+  while(!nl) {
+    if(in->p == in->end) {
+      if((rc = refill(in)) < 0) return -1;
+      if(rc == 0) break;
+    }
+    take = in->end - in->p;
+    if((nl = memchr(in->p, '\n', take)) != NULL)
+      take = nl - in->p + 1;
+    if(growline(in, i + take + 1) < 0)
+      return -1;
+    memcpy(in->line + i, in->p, take);
+    in->p += take;
+    i += take;
+  }
+  if(i == 0)
+    return 0;
+  in->line[i] = '\0';
+  i = strlen(in->line);  /* the matcher stops at a NUL anyway */
+  if(i > 0 && in->line[i-1] == '\n')
+    in->line[--i] = '\0';
+  *line = in->line;
+  *n = i;
+  return 1;
+}
+
+int
+closeinput(struct Input *in)
+{
+  int rc = 0;
+
+  if(in->gzip) {
+    atomic_store(&in->stop, 1);
+    sem_post(&in->empty);  /* in case it waits for a slot */
+    pthread_join(in->thread, NULL);
+    sem_destroy(&in->full);
+    sem_destroy(&in->empty);
+    inflateEnd(&in->z);
+    free(in->slots[0].data);
+  }
+  if(in->slot >= 0) {
+    release(in->slot, in->fd);
+    submit(0);
+  } else {
+    if(in->fd != STDIN_FILENO)
+      rc = close(in->fd);
+    free(in->buf);
+  }
+  free(in->line);
+  free(in);
+  return rc;
+}
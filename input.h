@@ -0,0 +1,45 @@
+/* A Regular Expression Library - Example Grep Input
+ * Copyright (c) 2012 Eric Mulvaney
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+
+struct Input;
+
+/* Open the file at path (or standard input, if path is NULL) for
+ * reading lines.  Gzip-compressed input is recognized by its first
+ * bytes and decompressed on another thread as it is read.  Returns
+ * NULL on error with errno set appropriately.
+ */
+struct Input *openinput(char *path);
+
+/* Read the next line, however long, without its newline: *line is
+ * set to it (NUL-terminated, in a buffer of the input's that the next
+ * call may reuse) and *n to its length.  Returns 1, or 0 at the end
+ * of the input, or -1 on error with errno set.
+ */
+int readline(struct Input *in, char **line, size_t *n);
+
+/* Close the input, stopping its decompression if need be. */
+int closeinput(struct Input *in);
+
+/* Start opening and reading the n files at paths through io_uring,
+ * a few at a time, ahead of openinput() asking for them (by the same
+ * pointers, in the same order).  Returns -1 with errno set if io_uring
+ * is unavailable; openinput() then reads every file itself.
+ */
+int prefetch(char **paths, int n);
+void endprefetch(void);
@@ -28,21 +28,32 @@
  * Each character in a regex can add at most one part to this tree
  * (see parselevel()), while adjacent parts are concatenated (adding
  * another).  Therefore, an upper-bound on the tree size is 2*N+5 for
- * a regex of size N (see parse()).
+ * a regex of size N (see treesize()).
  */
 enum { MIN_TREESIZE=5 };
 
 struct Tree {
   struct AST *root, *stack, *heap;
+  int depth, maxdepth;       /* of the groups being parsed */
+  int nclasses, maxclasses;  /* see compilelimited() */
 };
 
+size_t
+treesize(char *regex)
+{
+  return 2*strlen(regex) + MIN_TREESIZE;
+}
+
 static int
-inittree(struct Tree* t, size_t size)
+inittree(struct Tree* t, struct AST *nodes, size_t size)
 {
-  t->root = calloc(size, sizeof *t->root);
+  t->root = nodes ? nodes : calloc(size, sizeof *t->root);
   if(t->root == NULL) return (errno=ENOMEM, -1);
   t->stack = t->root;
   t->heap  = t->root + size;
+  t->depth = 0;
+  t->nclasses = 0;
+  t->maxdepth = t->maxclasses = 0;
   return 0;
 }
 
@@ -53,6 +64,34 @@ freetree(struct Tree *t)
   memset(t, 0, sizeof *t);
 }
 
+void
+freeranges(struct AST *x)
+{
+  for(;;) {
+    switch(x->op) {
+    case Ranges:
+      free(x->args.ranges.r);
+      return;
+    case Concat:
+    case Either:
+      freeranges(x->args.next.x);
+      x = x->args.next.y;
+      break;
+    case Optional:
+    case WeakOpt:
+    case Star:
+    case WeakStar:
+    case Plus:
+    case WeakPlus:
+    case Capture:
+      x = x->args.next.x;
+      break;
+    default:
+      return;
+    }
+  }
+}
+
 #define top(t)   ((t)->stack - 1)
 #define push(t)  ((t)->stack++)
 #define pop(t)   (*--(t)->heap = *--(t)->stack, (t)->heap)
@@ -80,27 +119,61 @@ concat(struct AST *bot, struct Tree *t)
 }
 
 static void
-addtoclass(struct Program *prog, unsigned mask, int c)
+addtoclass(struct Program *prog, unsigned char *set, int c)
 {
   if(!(prog->options & IgnoreCase) || !isalpha(c))
-    prog->charset[c] |= mask;
+    set[c] = 1;
   else {
-    prog->charset[tolower(c)] |= mask;
-    prog->charset[toupper(c)] |= mask;
+    set[tolower(c)] = 1;
+    set[toupper(c)] = 1;
+  }
+}
+
+/* Find the bit of prog->charset for the class of the bytes in set:
+ * that of an identical class if there is one (the rules given to
+ * compilerules() often repeat a class), else the next one free.
+ * Returns 0 if all 32 are taken.
+ */
+static unsigned
+classbit(struct Program *prog, unsigned char *set)
+{
+  unsigned mask, *charset = prog->charset;
+  int c;
+
+  for(mask = 1; mask != charset[0]; mask <<= 1) {  /* those in use */
+    for(c = 1; c <= UCHAR_MAX && !(charset[c] & mask) == !set[c]; c++)
+      ;
+    if(c > UCHAR_MAX)
+      return mask;
   }
+  if(mask == 0)
+    return 0;
+  charset[0] <<= 1;
+  for(c = 1; c <= UCHAR_MAX; c++)
+    if(set[c])
+      charset[c] |= mask;
+  return mask;
+}
+
+/* Count another [] class against the limit, if any. */
+static int
+newclass(struct Tree *t)
+{
+  if(t->maxclasses && ++t->nclasses > t->maxclasses)
+    return (errno=E2BIG, -1);
+  return 0;
 }
 
 static int
 parseclass(struct Tree *t, struct Program *prog, char **ref)
 {
   struct AST *x, *bot = t->stack;
-  unsigned char *sp = (unsigned char*)*ref;
-  unsigned mask = prog->charset[0];
+  unsigned char *sp = (unsigned char*)*ref, set[UCHAR_MAX+1] = {0};
+  unsigned mask;
   int c, negate = 0;
 
-  assert(mask != 0);  /* only 32 character classes allowed (TODO) */
-  assert(((mask - 1) & mask) == 0);  /* only one bit should be set */
-  prog->charset[0] <<= 1;
+  if(newclass(t))
+    return -1;
   if(*sp == '^') {
     sp++;
     negate = 1;
@@ -120,19 +193,21 @@ parseclass(struct Tree *t, struct Program *prog, char **ref)
     default:
     notspecial:
       if(sp[0] != '-' || sp[1] == ']' || sp[1] == '\0') {
-	addtoclass(prog, mask, c);
+	addtoclass(prog, set, c);
       } else { /* it's a range like "A-Z" */
 	for(; c <= sp[1]; c++)
-	  addtoclass(prog, mask, c);
+	  addtoclass(prog, set, c);
 	sp += 2;
       }
     }
   }
  finished:
   if(negate) {
-    for(c=1; c < UCHAR_MAX; c++)
-      prog->charset[c] ^= mask;
+    for(c=1; c <= UCHAR_MAX; c++)
+      set[c] ^= 1;
   }
+  if((mask = classbit(prog, set)) == 0)  /* a bit for each class: only 32 */
+    return (errno=E2BIG, -1);
   x = push(t);
   x->op = Charset;
   x->args.set.mask    = mask;
@@ -142,6 +217,128 @@ parseclass(struct Tree *t, struct Program *prog, char **ref)
   return 0;
 }
 
+/* Push the ranges as one part: a Charset if they are all ASCII and
+ * there is a class bit for them (the ranges are then freed), else
+ * Ranges, which takes them over.
+ */
+static void
+pushranges(struct Tree *t, struct Program *prog, struct RangeList *l)
+{
+  struct AST *x = push(t);
+  unsigned char set[UCHAR_MAX+1] = {0};
+  unsigned mask = 0;
+  int i, c;
+
+  if(l->n > 0 && l->r[l->n-1].hi <= 0x7F) {
+    for(i = 0; i < l->n; i++)
+      for(c = l->r[i].lo; c <= l->r[i].hi; c++)
+	set[c] = 1;
+    mask = classbit(prog, set);
+  }
+  if(mask) {
+    x->op = Charset;
+    x->args.set.mask    = mask;
+    x->args.set.charset = prog->charset;
+    free(l->r);
+  } else {
+    x->op = Ranges;
+    x->args.ranges.n = l->n;
+    x->args.ranges.r = l->r;
+  }
+}
+
+/* Parse a [] class of UTF-8 characters, as parseclass() does bytes. */
+static int
+parseranges(struct Tree *t, struct Program *prog, char **ref)
+{
+  struct RangeList l = {0};
+  char *sp = *ref;
+  int lo, hi, negate = 0;
+
+  if(newclass(t))
+    return -1;
+  if(*sp == '^') {
+    sp++;
+    negate = 1;
+  }
+  if(*sp == ']') {
+    lo = *sp++;
+    goto notspecial;
+  }
+  for(;;) {
+    if(*sp == '\0')
+      break;
+    if(*sp == ']') {
+      sp++;
+      break;
+    }
+    if((lo = utf8decode(&sp)) < 0) goto fail;
+  notspecial:
+    hi = lo;
+    if(sp[0] == '-' && sp[1] != ']' && sp[1] != '\0') {  /* a range */
+      sp++;
+      if((hi = utf8decode(&sp)) < 0) goto fail;
+    }
+    if(lo <= hi && addrange(&l, lo, hi)) goto fail;
+  }
+  normranges(&l);
+  if(prog->options & IgnoreCase && foldranges(&l)) goto fail;
+  if(negate && negateranges(&l)) goto fail;
+  pushranges(t, prog, &l);
+  *ref = sp;
+  return 0;
+ fail:
+  free(l.r);
+  return -1;
+}
+
+/* Push one UTF-8 character at *ref (the start of a multibyte one, or
+ * a letter), moving *ref past it.  With IgnoreCase, a character with
+ * more cases than compiletree() can match by itself becomes Ranges;
+ * otherwise it is a concatenation of its bytes.
+ */
+static int
+parsechar(struct Tree *t, struct Program *prog, char **ref)
+{
+  struct RangeList l = {0};
+  struct AST *x, *bot = t->stack;
+  char *sp = *ref;
+  int i, n, c, cases[4];
+
+  if((c = utf8decode(&sp)) < 0)
+    return -1;
+  n = prog->options & IgnoreCase ? casefold(c, cases) : 1;
+  if(n > 2 || (n == 2 && c > 0x7F)) {
+    for(i = 0; i < n; i++)
+      if(addrange(&l, cases[i], cases[i])) {
+	free(l.r);
+	return -1;
+      }
+    normranges(&l);
+    pushranges(t, prog, &l);
+  } else {
+    for(; *ref < sp; ++*ref) {
+      x = push(t);
+      x->op = Onechar;
+      x->args.c = **ref;
+    }
+    concat(bot, t);
+  }
+  *ref = sp;
+  return 0;
+}
+
+/* Every character but NUL (and the surrogates, which UTF-8 excludes). */
+static int
+anyrune(struct Tree *t, struct Program *prog)
+{
+  struct RangeList l = {0};
+
+  if(addrange(&l, 1, 0x10FFFF)) return -1;
+  pushranges(t, prog, &l);
+  return 0;
+}
+
 static int
 parselevel(struct Tree *t, struct Program *prog, char **ref, int level)
 {
@@ -149,6 +346,8 @@ parselevel(struct Tree *t, struct Program *prog, char **ref, int level)
   char c, *sp = *ref;
   int rc;
 
+  if(t->maxdepth && t->depth > t->maxdepth)
+    return (errno=E2BIG, -1);
   for(;;) {
     c = *sp++;
     switch(c) {
@@ -157,15 +356,30 @@ parselevel(struct Tree *t, struct Program *prog, char **ref, int level)
 	c = *sp++;
       /* no break */
     default: onechar:
+      if((prog->options & UTF8) &&
+	 (c & 0x80 || ((prog->options & IgnoreCase) && isalpha(c)))) {
+	sp--;
+	rc = parsechar(t, prog, &sp);
+	if(rc) return rc;
+	break;
+      }
       x = push(t);
       x->op = Onechar;
       x->args.c = c;
       break;
     case '.':
+      if(prog->options & UTF8) {
+	rc = anyrune(t, prog);
+	if(rc) return rc;
+	break;
+      }
       push(t)->op = Anychar;
       break;
     case '[':
-      rc = parseclass(t, prog, &sp);
+      if(prog->options & UTF8)
+	rc = parseranges(t, prog, &sp);
+      else
+	rc = parseclass(t, prog, &sp);
       if(rc) return rc;
       break;
     case '?':
@@ -192,7 +406,7 @@ parselevel(struct Tree *t, struct Program *prog, char **ref, int level)
     case '|':
       concat(bot, t);
       x = top(t);
-      rc = parselevel(t, prog, &sp, level);
+      rc = parselevel(t, prog, &sp, level);  /* no deeper */
       if(rc) return rc;
       y = top(t);
       if(x->op == Epsilon && y->op == Epsilon) {
@@ -211,9 +425,11 @@ parselevel(struct Tree *t, struct Program *prog, char **ref, int level)
 	z->args.next.x = x;
 	z->args.next.y = y;
       }
-      break;
+      goto finish;  /* the right side ended this level */
     case '(':
+      t->depth++;
       rc = parselevel(t, prog, &sp, level+1);
+      t->depth--;
       if(rc) return rc;
       x = pop(t);
       y = push(t);
@@ -244,9 +460,10 @@ parseregex(struct Tree *t, struct Program *prog, char *sp)
   struct AST *x, *y, *bot = t->stack;
   int rc;
 
-  if(*sp == '^')
+  if(*sp == '^') {
     sp++;
-  else {
+    prog->options |= Anchored;
+  } else if(!(prog->options & Anchored)) {
     push(t)->op = Anychar;
     x = pop(t);
     y = push(t);
@@ -262,32 +479,72 @@ parseregex(struct Tree *t, struct Program *prog, char *sp)
   if(*sp == '$') {
     sp++;
     push(t)->op = Dollar;
+    prog->options |= AnchoredEnd;
   }
   concat(bot, t);
   assert(top(t) == bot);
   return 0;
 }
 
-int
-parse(struct AST **ast, struct Program *prog, char *regex)
+/* Parse into nodes, or into a new tree if nodes is NULL. */
+static int
+parsetree(struct AST **ast, struct AST *nodes, struct Program *prog,
+	  char *regex)
 {
   struct Tree t;
-  size_t max = 2*strlen(regex) + MIN_TREESIZE;
   int rc;
 
   if(!ast || !prog || !regex)
     return (errno=EINVAL, -1);
-  rc = inittree(&t, max);
+  rc = inittree(&t, nodes, treesize(regex));
   if(rc) return rc;
-  memset(prog->charset, 0, sizeof prog->charset);
-  prog->charset[0] = 1;  /* the next bit to use */
+  if(prog->limits) {
+    t.maxdepth   = prog->limits->maxdepth;
+    t.maxclasses = prog->limits->maxclasses;
+  }
   rc = parseregex(&t, prog, regex);
-  prog->charset[0] = 0;  /* we never match NULs */
   assert(t.stack <= t.heap);  /* overflow check */
   if(rc) {
-    freetree(&t);
+    while(t.stack > t.root)
+      freeranges(--t.stack);
+    if(!nodes) freetree(&t);
     return rc;
   }
   *ast = t.root;
   return 0;
 }
+
+int
+parsemore(struct AST **ast, struct Program *prog, char *regex)
+{
+  return parsetree(ast, NULL, prog, regex);
+}
+
+int
+parseinto(struct AST **ast, struct AST *nodes, struct Program *prog,
+	  char *regex)
+{
+  int rc;
+
+  if(!prog || !prog->charset)
+    return (errno=EINVAL, -1);
+  memset(prog->charset, 0, (UCHAR_MAX+1) * sizeof *prog->charset);
+  prog->charset[0] = 1;  /* the next bit to use */
+  rc = parsetree(ast, nodes, prog, regex);
+  prog->charset[0] = 0;  /* we never match NULs */
+  return rc;
+}
+
+int
+parse(struct AST **ast, struct Program *prog, char *regex)
+{
+  return parseinto(ast, NULL, prog, regex);
+}
+
+void
+freeast(struct AST *ast)
+{
+  if(ast == NULL) return;
+  freeranges(ast);
+  free(ast);
+}
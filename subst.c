@@ -0,0 +1,103 @@
+/* A Regular Expression Library - Substitution
+ * Copyright (c) 2012 Eric Mulvaney
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "core.h"
+
+/* A template of N bytes has at most N pieces (each takes at least one
+ * byte), plus the one that ends it.
+ */
+struct Piece*
+parsetemplate(char *tmpl)
+{
+  struct Piece *p, *pieces;
+  size_t len;
+
+  if(!tmpl)
+    return (errno=EINVAL, NULL);
+  pieces = malloc((strlen(tmpl) + 1) * sizeof *pieces);
+  if(pieces == NULL) return (errno=ENOMEM, NULL);
+  for(p = pieces; *tmpl; p++) {
+    p->text = tmpl;
+    p->capture = -1;
+    if((len = strcspn(tmpl, "$")) != 0) {
+      p->len = len;
+      tmpl += len;
+    } else if(isdigit((unsigned char)tmpl[1])) {
+      p->text = NULL;
+      p->capture = tmpl[1] - '0';
+      tmpl += 2;
+    } else {
+      switch(tmpl[1]) {
+        case '$':  p->text = ++tmpl;  /* no break */
+        case '\0': p->len = 1; break;
+        default:   p->len = 2;
+      }
+      tmpl += p->len;
+    }
+  }
+  p->text = NULL;
+  p->capture = -1;
+  return pieces;
+}
+
+int
+expand(struct Piece *tmpl, char **saved,
+       int (*emit)(void *arg, char *s, size_t len), void *arg)
+{
+  int i;
+
+  for(; tmpl->text || tmpl->capture >= 0; tmpl++) {
+    if(tmpl->text) {
+      if(emit(arg, tmpl->text, tmpl->len))
+	return -1;
+      continue;
+    }
+    i = 2 * tmpl->capture;
+    if(saved[i] && saved[i+1] && emit(arg, saved[i], saved[i+1] - saved[i]))
+      return -1;
+  }
+  return 0;
+}
+
+int
+substitute(struct Matcher *m, char *input, struct Piece *tmpl, int all,
+	   int (*emit)(void *arg, char *s, size_t len), void *arg)
+{
+  char *sp = input;
+  int rc, n = 0;
+
+  if(!m || !input || !tmpl || !emit)
+    return (errno=EINVAL, -1);
+  setinput(m, input);
+  while((rc = nextmatch(m)) > 0) {
+    n++;
+    if(emit(arg, sp, m->saved[0] - sp) || expand(tmpl, m->saved, emit, arg))
+      return -1;
+    sp = m->saved[1];
+    if(!all)
+      break;
+  }
+  if(rc < 0)
+    return -1;
+  if(n > 0 && emit(arg, sp, strlen(sp)))
+    return -1;
+  return n;
+}
@@ -22,6 +22,16 @@
 #include <string.h>
 #include "core.h"
 
+#ifdef VM_STATS
+#define count(stats, expr)  ((stats) ? (void)((stats)->expr) : (void)0)
+#define peak(stats, n)  \
+  ((stats) && (n) > (stats)->maxthreads ? (void)((stats)->maxthreads = (n)) \
+                                        : (void)0)
+#else
+#define count(stats, expr)  ((void)0)
+#define peak(stats, n)      ((void)0)
+#endif
+
 struct Thread {
   struct Inst *pc;  /* this thread's program counter */
   char *saved[20];  /* for Save instructions */
@@ -47,34 +57,49 @@ thread(struct Inst *pc, char **saved)
 struct ThreadList {
   struct Thread *t;  /* storage for the thread list */
   struct Inst *pc0;  /* the first instruction of the program */
+  struct Stats *stats;  /* see count() */
   int n;    /* the number of threads in the list */
   int max;  /* the capacity of the list */
   int id;   /* to mark instructions while adding threads to list */
 };
 
-static int
-initlist(struct ThreadList *list, struct Program *prog)
+static void
+initlist(struct ThreadList *list, struct Program *prog, struct Thread *t)
 {
   assert(prog->size > 0);
   list->n   = 0;
   list->max = prog->size;  /* we need room for all instructions */
   list->pc0 = prog->code;
   list->id  = 1;
-  list->t = calloc(list->max, sizeof *list->t);
-  return list->t ? 0 : (errno=ENOMEM, -1);
+  list->stats = prog->stats;
+  list->t = t;
 }
 
-static void
-freelist(struct ThreadList* list)
+/* The two thread lists used by search(), allocated together.  A
+ * Matcher keeps them between searches; vm() makes new ones.
+ */
+struct Lists {
+  struct ThreadList clist, nlist;
+  struct Thread t[];  /* 2 * prog->size threads */
+};
+
+static struct Lists*
+newlists(struct Program *prog)
 {
-  free(list->t);
-  list->t = NULL;
+  struct Lists *l;
+
+  count(prog->stats, allocs++);
+  l = calloc(1, sizeof *l + 2 * prog->size * sizeof *l->t);
+  if(l == NULL) return (errno=ENOMEM, NULL);
+  initlist(&l->clist, prog, l->t);
+  initlist(&l->nlist, prog, l->t + prog->size);
+  return l;
 }
 
 static void
-swap(struct ThreadList* alist, struct ThreadList *blist)
+swap(struct ThreadList **alist, struct ThreadList **blist)
 {
-  struct ThreadList tmp;
+  struct ThreadList *tmp;
   tmp = *alist; *alist = *blist; *blist = tmp;
 }
 
@@ -102,6 +127,7 @@ addthread(struct ThreadList *list, char *sp, struct Thread t)
     if(list->t[i].listid == list->id)
       break;  /* instruction already explored */
     list->t[i].listid = list->id;
+    count(list->stats, hits[i]++);
     switch(t.pc->opcode) {
     case Jump:
       t.pc = t.pc->args.next.x;
@@ -118,42 +144,120 @@ addthread(struct ThreadList *list, char *sp, struct Thread t)
       p = &list->t[list->n++];
       t.listid = p->listid;
       *p = t;
+      count(list->stats, threads++);
       return;
     }
+    count(list->stats, steps++);
   }
 }
 
-int
-vm(struct Program *prog, char *input, char **saved)
+/* Skip to the next byte that can begin a match (or to the end). */
+static char*
+skip(struct Program *prog, char *sp)
 {
-  struct ThreadList clist={0}, nlist={0};
-  struct Thread *t;
-  struct Inst *pc;
-  char *sp = input;
-  int i, j, rc=0;
+  char *p;
 
-  if(!prog || !input || !saved || !prog->code || prog->size < 1)
-    return (errno=EINVAL, -1);
+  if(prog->nfirst == 1) {
+    p = strchr(sp, prog->firstc);
+    return p ? p : sp + strlen(sp);
+  }
+  while(*sp && !prog->first[(unsigned char)*sp])
+    sp++;
+  return sp;
+}
+
+/* Find a pattern that is just a literal string, without threads. */
+static int
+findliteral(struct Program *prog, char *sp, char **saved)
+{
+  size_t len, n = prog->minlen;
+  char *p;
+
+  switch(prog->options & (Anchored|AnchoredEnd)) {
+  case 0:
+    p = strstr(sp, prog->literal);
+    break;
+  case Anchored:
+    p = strncmp(sp, prog->literal, n) ? NULL : sp;
+    break;
+  default:
+    len = strlen(sp);
+    p = len < n ? NULL : sp + len - n;
+    if(p && (memcmp(p, prog->literal, n) ||
+	     ((prog->options & Anchored) && p != sp)))
+      p = NULL;
+  }
+  if(p == NULL)
+    return 0;
+  saved[0] = p;
+  saved[1] = p + n;
+  return 1;
+}
 
-  rc = initlist(&clist, prog);  if(rc) goto done;
-  rc = initlist(&nlist, prog);  if(rc) goto done;
+/* Search for the leftmost match starting at or after sp.
+ *
+ * Whenever no thread is running but those of the start state (the
+ * unanchored prefix and what it leads to), the search skips ahead to
+ * a byte that can begin a match, and starts again from there.
+ * Before that, what is known of the matches' lengths may rule out a
+ * match, or the first part of the input; literals need no threads.
+ * The threads run at each byte count against prog's limit on steps.
+ * The kind of match wanted is that of options (prog's own, or with
+ * Earliest added by matchbatch()), so that prog is never written.
+ */
+static int
+search(struct Program *prog, struct Lists *l, char *sp, char **saved,
+       int options)
+{
+  struct ThreadList *clist, *nlist;
+  struct Thread *t;
+  struct Inst *pc, *prefix = NULL;
+  int i, j, alive, rc=0;
+  unsigned long steps = 0, budget = prog->limits ? prog->limits->maxsteps : 0;
+  size_t len;
 
   memset(saved, 0, sizeof t->saved);
-  addthread(&clist, sp, thread(prog->code, saved));
+  if(prog->minlen > 0 && strnlen(sp, prog->minlen) < (size_t)prog->minlen)
+    return 0;  /* too short to match */
+  if(prog->literal)
+    return findliteral(prog, sp, saved);
+  if((prog->options & (Anchored|AnchoredEnd)) == AnchoredEnd &&
+     prog->maxlen >= 0 && (len = strlen(sp)) > (size_t)prog->maxlen)
+    sp += len - prog->maxlen;  /* a match must end at the end */
+  clist = &l->clist;
+  nlist = &l->nlist;
+  clear(clist);
+  clear(nlist);
+  if(prog->nfirst <= UCHAR_MAX) {
+    prefix = &prog->code[1];  /* the prefix's AnyChar */
+    sp = skip(prog, sp);
+  }
+  addthread(clist, sp, thread(prog->code, saved));
   do {
-    for(i = 0; i < clist.n; i++) {
-      t = &clist.t[i];
+    if(budget && (steps += clist->n) > budget)
+      return (errno=ETIME, -1);
+    alive = 0;
+    count(prog->stats, bytes++);
+    peak(prog->stats, clist->n);
+    for(i = 0; i < clist->n; i++) {
+      t = &clist->t[i];
       pc = t->pc;
       switch(pc->opcode) {
       case CharAlt: if(*sp == pc->args.chr.alt) goto okay; /* no break */
       case Char:    if(*sp == pc->args.chr.c  ) goto okay;
 	break;
+      case ByteRange:
+	if((unsigned char)*sp < pc->args.chr.c ||
+	   (unsigned char)*sp > pc->args.chr.alt)
+	  break;
+	goto okay;
       case CharSet:
 	if(!(pc->args.set.charset[(unsigned char)*sp] & pc->args.set.mask))
 	  break;
 	/* no break */
       case AnyChar: okay:
-	addthread(&nlist, sp+1, thread(t->pc+1, t->saved));
+	addthread(nlist, sp+1, thread(t->pc+1, t->saved));
+	alive |= pc != prefix;
 	break;
       case MatchEnd:
 	if(*sp) break;
@@ -162,23 +266,261 @@ vm(struct Program *prog, char *input, char **saved)
 	memcpy(saved, t->saved, sizeof t->saved);
 	rc = 1;  /* first or longer match found */
 	assert(t->saved[0] != NULL);
-	j = clist.n - 1;
-	while(clist.t[j].saved[0] == NULL ||
-	      clist.t[j].saved[0] > t->saved[0])
+	if(options & Earliest)
+	  return rc;
+	if(options & LeftmostFirst) {
+	  clist->n = i + 1;  /* drop threads of lower priority */
+	  break;
+	}
+	j = clist->n - 1;
+	while(clist->t[j].saved[0] == NULL ||
+	      clist->t[j].saved[0] > t->saved[0])
 	  j--;
-	clist.n = j + 1;  /* drop threads matching later */
+	clist->n = j + 1;  /* drop threads matching later */
 	break;
       default: /* should have been handled by addthread() */
 	abort();
       }
     }
     swap(&clist, &nlist);
-    clear(&nlist);
-  } while(*sp++ && clist.n > 0);
- done:
-  i = errno;
-  freelist(&clist);
-  freelist(&nlist);
-  errno = i;
+    clear(nlist);
+    if(prefix && !alive && !rc && *sp && !prog->first[(unsigned char)sp[1]]) {
+      sp = skip(prog, sp+1) - 1;
+      clear(clist);
+      addthread(clist, sp+1, thread(prog->code, saved));
+    }
+  } while(*sp++ && clist->n > 0);
+  return rc;
+}
+
+int
+vm(struct Program *prog, char *input, char **saved)
+{
+  struct Lists *l;
+  int rc;
+
+  if(!prog || !input || !saved || !prog->code || prog->size < 1)
+    return (errno=EINVAL, -1);
+  count(prog->stats, calls++);
+  if(prog->dfa && !dfaexec(prog->dfa, input)) {
+    memset(saved, 0, sizeof l->t->saved);
+    return 0;  /* no need to find the captures */
+  }
+  if(prog->literal)
+    return search(prog, NULL, input, saved, prog->options);  /* no threads */
+  if((l = newlists(prog)) == NULL)
+    return -1;
+  rc = search(prog, l, input, saved, prog->options);
+  free(l);
   return rc;
 }
+
+int
+matchbatch(struct Program *prog, char **inputs, int n, int *results)
+{
+  struct Lists *l = NULL;
+  char *saved[20];
+  int i;
+
+  if(!prog || !prog->code || prog->size < 1 || n < 0 ||
+     (n > 0 && (!inputs || !results)))
+    return (errno=EINVAL, -1);
+  count(prog->stats, calls += n);
+  if(prog->dfa)
+    return dfabatch(prog->dfa, inputs, NULL, n, results);
+  if(!prog->literal && (l = newlists(prog)) == NULL)
+    return -1;
+  for(i = 0; i < n; i++)  /* any match will do */
+    if((results[i] = search(prog, l, inputs[i], saved,
+			    prog->options | Earliest)) < 0)
+      break;
+  free(l);
+  return i < n ? -1 : 0;
+}
+
+int
+initmatcher(struct Matcher *m, struct Program *prog)
+{
+  if(!m || !prog || !prog->code || prog->size < 1)
+    return (errno=EINVAL, -1);
+  memset(m, 0, sizeof *m);
+  m->prog = prog;
+  m->lists = newlists(prog);
+  return m->lists ? 0 : -1;
+}
+
+void
+setinput(struct Matcher *m, char *input)
+{
+  m->input = m->sp = input;
+  m->last = NULL;
+}
+
+/* Where the search goes on after an empty match at sp: the next byte,
+ * or with UTF8, the next character, so that no match starts inside one.
+ */
+static char *
+pastchar(struct Program *prog, char *sp)
+{
+  sp++;
+  if(prog->options & UTF8)
+    while((*sp & 0xC0) == 0x80)
+      sp++;
+  return sp;
+}
+
+int
+nextmatch(struct Matcher *m)
+{
+  struct Program *prog = m->prog;
+  char *start, *end;
+  int rc = 0;
+
+  if(m->sp == NULL)
+    return 0;  /* no more matches */
+  count(prog->stats, calls++);
+  if(m->sp == m->input && prog->dfa && !dfaexec(prog->dfa, m->sp))
+    goto nomore;
+  for(;;) {
+    if((rc = search(prog, m->lists, m->sp, m->saved, prog->options)) <= 0)
+      goto nomore;
+    start = m->saved[0];
+    end   = m->saved[1];
+    if(start != end || start != m->last)
+      break;
+    /* An empty match right after the last match doesn't count. */
+    if(!*start || (prog->options & Anchored)) {
+      rc = 0;
+      goto nomore;
+    }
+    m->sp = pastchar(prog, start);
+  }
+  m->last = end;
+  if(prog->options & Anchored)
+    m->sp = NULL;
+  else if(end > start)
+    m->sp = end;
+  else
+    m->sp = *end ? pastchar(prog, end) : NULL;
+  return 1;
+ nomore:
+  memset(m->saved, 0, sizeof m->saved);
+  m->sp = NULL;
+  return rc;
+}
+
+int
+anymatch(struct Matcher *m, char *input)
+{
+  char *saved[20];
+
+  if(!m || !m->lists || !input)
+    return (errno=EINVAL, -1);
+  count(m->prog->stats, calls++);
+  if(m->prog->dfa)
+    return dfaexec(m->prog->dfa, input);
+  return search(m->prog, m->lists, input, saved, m->prog->options | Earliest);
+}
+
+void
+freematcher(struct Matcher *m)
+{
+  free(m->lists);
+  m->lists = NULL;
+}
+
+/* Does the instruction at pc accept the byte c? (as in search()) */
+static int
+accepts(struct Inst *pc, int c)
+{
+  switch(pc->opcode) {
+  case CharAlt:   if(c == pc->args.chr.alt) return 1; /* no break */
+  case Char:      return c == pc->args.chr.c;
+  case CharSet:   return !!(pc->args.set.charset[(unsigned char)c] &
+			    pc->args.set.mask);
+  case ByteRange: return (unsigned char)c >= pc->args.chr.c &&
+			 (unsigned char)c <= pc->args.chr.alt;
+  case AnyChar:   return 1;
+  default:        return 0;
+  }
+}
+
+/* The threads run from sp alone; each Match reached is a token ending
+ * here.  Later positions give longer tokens, so each replaces the
+ * last; at one position, the first Match in the list (that of the
+ * rule listed first) is taken.  Steps count as in search().
+ */
+int
+scan(struct Matcher *m, char *sp, char **end, int *id)
+{
+  struct ThreadList *clist, *nlist;
+  struct Thread *t;
+  struct Inst *pc;
+  char *saved[20];
+  int i, found, rc = 0;
+  unsigned long steps = 0, budget;
+
+  if(!m || !m->lists || !sp || !end || !id)
+    return (errno=EINVAL, -1);
+  budget = m->prog->limits ? m->prog->limits->maxsteps : 0;
+  count(m->prog->stats, calls++);
+  clist = &((struct Lists*)m->lists)->clist;
+  nlist = &((struct Lists*)m->lists)->nlist;
+  clear(clist);
+  clear(nlist);
+  memset(saved, 0, sizeof saved);
+  addthread(clist, sp, thread(m->prog->code, saved));
+  do {
+    if(budget && (steps += clist->n) > budget)
+      return (errno=ETIME, -1);
+    found = 0;
+    count(m->prog->stats, bytes++);
+    peak(m->prog->stats, clist->n);
+    for(i = 0; i < clist->n; i++) {
+      t = &clist->t[i];
+      pc = t->pc;
+      switch(pc->opcode) {
+      case MatchEnd:
+	if(*sp) break;
+	/* no break */
+      case Match:
+	if(!found) {
+	  found = rc = 1;
+	  *end = sp;
+	  *id = pc->args.i;
+	}
+	break;
+      default:
+	if(accepts(pc, *sp))
+	  addthread(nlist, sp+1, thread(pc+1, t->saved));
+      }
+    }
+    swap(&clist, &nlist);
+    clear(nlist);
+  } while(*sp++ && clist->n > 0);
+  return rc;
+}
+
+int
+initstats(struct Stats *stats, struct Program *prog)
+{
+  if(!stats || !prog || prog->size < 1)
+    return (errno=EINVAL, -1);
+#ifndef VM_STATS
+  return (errno=ENOSYS, -1);
+#else
+  memset(stats, 0, sizeof *stats);
+  stats->hits = calloc(prog->size, sizeof *stats->hits);
+  if(stats->hits == NULL)
+    return (errno=ENOMEM, -1);
+  prog->stats = stats;
+  return 0;
+#endif
+}
+
+void
+freestats(struct Stats *stats)
+{
+  free(stats->hits);
+  stats->hits = NULL;
+}